@@ -22,6 +22,7 @@ void setup()
 void loop() {
   if (runEvery(5000))
   {
+    LoRaWan_answerMac();
     LoRaWanPacket.clear();
     LoRaWanPacket.print("Hello World");
     if (LoRaWanPacket.encode()) 
@@ -31,6 +32,16 @@ void loop() {
   }
 }
 
+// decode() sets a bit of Mac.Received for every setting a downlink asks for;
+// this sketch keeps its radio settings, so the answers refuse the new ones
+void LoRaWan_answerMac()
+{
+  for (uint8_t cid = MCMD_LINK_ADR_REQ; cid <= MCMD_DL_CHANNEL_REQ; cid++) {
+    if (LoRaWanPacket.Mac.Received & MCMD_BIT(cid))
+      MacAnswer(&LoRaWanPacket.Mac, cid, 0x00);
+  }
+}
+
 boolean runEvery(unsigned long interval)
 {
   static unsigned long previousMillis = 0;
@@ -81,6 +81,7 @@ void loop() {
 void LoRa_sendMessage()
 {
   LoRa_TxMode();
+  LoRaWan_answerMac();
   LoRaWanPacket.clear();
   LoRaWanPacket.print("Hello World");
   if (LoRaWanPacket.encode()) 
@@ -91,6 +92,16 @@ void LoRa_sendMessage()
   }
 }
 
+// decode() sets a bit of Mac.Received for every setting a downlink asks for;
+// this sketch keeps its radio settings, so the answers refuse the new ones
+void LoRaWan_answerMac()
+{
+  for (uint8_t cid = MCMD_LINK_ADR_REQ; cid <= MCMD_DL_CHANNEL_REQ; cid++) {
+    if (LoRaWanPacket.Mac.Received & MCMD_BIT(cid))
+      MacAnswer(&LoRaWanPacket.Mac, cid, 0x00);
+  }
+}
+
 boolean runEvery(unsigned long interval)
 {
   static unsigned long previousMillis = 0;
@@ -143,8 +143,15 @@ void onReceive(int packetSize) {
   while (LoRa.available()) {
     LoRaWanPacket.write(LoRa.read());
   }
+  LoRaWanPacket.Mac.Snr = LoRa.packetSnr();
   int port = LoRaWanPacket.decode();
   int length = LoRaWanPacket.length();
+
+  // this sketch keeps its radio settings, the answers refuse the new ones
+  for (uint8_t cid = MCMD_LINK_ADR_REQ; cid <= MCMD_DL_CHANNEL_REQ; cid++) {
+    if (LoRaWanPacket.Mac.Received & MCMD_BIT(cid))
+      MacAnswer(&LoRaWanPacket.Mac, cid, 0x00);
+  }
   switch (port) {
     case 0:
       break;
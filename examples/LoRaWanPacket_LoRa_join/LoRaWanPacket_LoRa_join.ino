@@ -14,6 +14,7 @@ void setup()
 
 void loop() {
   LoRa_loop();
+  LoRaWan_events();
   if (runEvery(10000)) {
     if (!LoRa_busy())
     {
@@ -37,3 +38,23 @@ boolean runEvery(unsigned long interval)
   }
   return false;
 }
+
+void LoRaWan_events()
+{
+  LoRaWanEvent event;
+  while (LoRaWanPacket.readEvent(&event)) {
+    switch (event.Type) {
+      case LORAWAN_EVENT_MAC:
+        Serial.print("mac: ");
+        Serial.println(event.Value, HEX);
+        break;
+      case LORAWAN_EVENT_MIC_ERROR:
+        Serial.println("Mic Error");
+        break;
+      case LORAWAN_EVENT_REPLAY:
+        Serial.print("Replay: ");
+        Serial.println(event.FCnt);
+        break;
+    }
+  }
+}
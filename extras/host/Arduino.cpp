@@ -0,0 +1,11 @@
+// ----------------------------------------------- //
+// Arduino.cpp
+// ----------------------------------------------- //
+//
+// Minimal Arduino core for the native host build
+//
+// ----------------------------------------------- //
+
+#include "Arduino.h"
+
+HostSerial Serial;
@@ -0,0 +1,96 @@
+// ----------------------------------------------- //
+// Arduino.h
+// ----------------------------------------------- //
+//
+// Minimal Arduino core for the native host build,
+// only what the library itself uses
+//
+// ----------------------------------------------- //
+
+#ifndef ARDUINO_HOST_H
+#define ARDUINO_HOST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HEX 16
+#define DEC 10
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size)
+  {
+    size_t n = 0;
+    while (size--)
+      n += write(*buffer++);
+    return n;
+  }
+
+  size_t print(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(long v, int base = DEC)
+  {
+    char t[24];
+    snprintf(t, sizeof(t), (base == HEX) ? "%lX" : "%ld", v);
+    return print(t);
+  }
+  size_t print(unsigned long v, int base = DEC)
+  {
+    char t[24];
+    snprintf(t, sizeof(t), (base == HEX) ? "%lX" : "%lu", v);
+    return print(t);
+  }
+  size_t print(int v, int base = DEC) { return print((long)v, base); }
+  size_t print(unsigned int v, int base = DEC) { return print((unsigned long)v, base); }
+  size_t print(unsigned char v, int base = DEC) { return print((unsigned long)v, base); }
+
+  size_t println() { return print("\n"); }
+  template <typename T> size_t println(T v) { size_t n = print(v); return n + println(); }
+  template <typename T> size_t println(T v, int base) { size_t n = print(v, base); return n + println(); }
+};
+
+class Stream : public Print {
+protected:
+  unsigned long _timeout = 1000;
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  virtual void flush() {}
+  void setTimeout(unsigned long timeout) { _timeout = timeout; }
+};
+
+// Serial writes to stdout
+class HostSerial : public Stream {
+public:
+  size_t write(uint8_t c) { return (fputc(c, stdout) == EOF) ? 0 : 1; }
+  int available() { return 0; }
+  int read() { return -1; }
+  int peek() { return -1; }
+  void begin(unsigned long) {}
+  operator bool() { return true; }
+};
+
+extern HostSerial Serial;
+
+inline long random(long max) { return (max > 0) ? rand() % max : 0; }
+
+inline unsigned long micros()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000UL + t.tv_nsec / 1000;
+}
+
+inline unsigned long millis() { return micros() / 1000; }
+
+#endif
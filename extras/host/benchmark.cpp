@@ -0,0 +1,200 @@
+// ----------------------------------------------- //
+// benchmark.cpp
+// ----------------------------------------------- //
+//
+// Microbenchmarks of the crypto and codec paths,
+// built natively by the Makefile next to it
+//
+//   ./benchmark            payload sizes 1, 16, 51, 115, 222, 242
+//   ./benchmark all        every payload size 1...242
+//
+// ----------------------------------------------- //
+
+#include <Arduino.h>
+#include "LoRaWanPacket.h"
+
+#define BENCH_MIN_NS 20000000.0 // each measurement runs for at least 20 ms
+#define BENCH_MAX_PAYLOAD 242
+
+static uint8_t NwkSKey[16] = {0x2B, 0x7E, 0x15, 0x16, 0x28, 0xAE, 0xD2, 0xA6, 0xAB, 0xF7, 0x15, 0x88, 0x09, 0xCF, 0x4F, 0x3C};
+static uint8_t AppSKey[16] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F};
+static uint8_t DevAddr[4] = {0x26, 0x01, 0x1B, 0xDA};
+
+static double now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+// ----------------------------------------------------------------------------
+// bench
+// Runs op until BENCH_MIN_NS passed, the best of three rounds is kept.
+// Returns ns per call.
+// ----------------------------------------------------------------------------
+template <typename Op>
+static double bench(Op op)
+{
+  uint32_t n = 1;
+  double t;
+
+  for (;;)
+  {
+    t = now();
+    for (uint32_t i = 0; i < n; i++)
+      op();
+    t = now() - t;
+    if (t >= BENCH_MIN_NS)
+      break;
+    n = (t > 0) ? (uint32_t)(n * (BENCH_MIN_NS * 1.2 / t)) + 1 : n * 2;
+  }
+
+  double best = t;
+  for (int round = 0; round < 2; round++)
+  {
+    t = now();
+    for (uint32_t i = 0; i < n; i++)
+      op();
+    t = now() - t;
+    if (t < best)
+      best = t;
+  }
+  return best / n;
+}
+
+static void report(const char *name, int size, double ns)
+{
+  printf("%-28s %5d %12.1f %12.2f\n", name, size, ns, (size > 0) ? size * 1e3 / ns : 0.0);
+}
+
+static const char *backend()
+{
+#if defined(AES_USE_AESNI)
+  if (AES_NI_Supported())
+    return "AES-NI";
+#endif
+#if defined(AES_USE_BITSLICE)
+  return "bitsliced";
+#elif defined(AES_USE_TTABLE)
+  return "T-table";
+#else
+  return "byte";
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// Fixed size operations
+// ----------------------------------------------------------------------------
+static void benchKeys()
+{
+  uint8_t block[16] = {0};
+  uint8_t k1[16], k2[16];
+  uint8_t appNonce[6] = {1, 2, 3, 4, 5, 6};
+  uint8_t nwkSKey[16], appSKey[16];
+  AES_Context aes;
+  AES_Expand_Key(&aes, AppSKey);
+
+  report("AES_Encrypt (key)", 16, bench([&]() { AES_Encrypt(block, AppSKey); }));
+  report("AES_Encrypt (context)", 16, bench([&]() { AES_Encrypt(block, &aes); }));
+  report("AES_Expand_Key", 0, bench([&]() { AES_Expand_Key(&aes, block); }));
+  report("generate_subkey (key)", 0, bench([&]() { generate_subkey(NwkSKey, k1, k2); }));
+  report("generate_subkey (context)", 0, bench([&]() { generate_subkey(&aes, k1, k2); }));
+  report("JoinComputeSKeys (key)", 0, bench([&]() { JoinComputeSKeys(AppSKey, appNonce, 0x1234, nwkSKey, appSKey); }));
+  report("JoinComputeSKeys (context)", 0, bench([&]() { JoinComputeSKeys(&aes, appNonce, 0x1234, nwkSKey, appSKey); }));
+}
+
+// ----------------------------------------------------------------------------
+// Operations over a FRMPayload of size bytes
+// ----------------------------------------------------------------------------
+static void benchPayload(LoRaWanPacketBase &packet, int size)
+{
+  uint8_t frame[256];
+  uint8_t work[256];
+  LoRaWanView view;
+  CMAC_Key cmac;
+  AES_Context aes;
+  generate_cmac_key(&cmac, NwkSKey);
+  AES_Expand_Key(&aes, AppSKey);
+
+  for (int i = 0; i < size; i++)
+    work[i] = i;
+
+  report("PayloadEncode (key)", size, bench([&]() { PayloadEncode(work, size, AppSKey, DevAddr, 1, 0); }));
+  report("PayloadEncode (context)", size, bench([&]() { PayloadEncode(work, size, &aes, DevAddr, 1, 0); }));
+  report("PayloadComputeMic (key)", size, bench([&]() { PayloadComputeMic(work, size, NwkSKey, 1, 0); }));
+  report("PayloadComputeMic (CMAC_Key)", size, bench([&]() { PayloadComputeMic(work, size, &cmac, 1, 0); }));
+  report("PayloadEncodeMic", size, bench([&]() {
+    Payload_Fragment payload = {work, (uint16_t)size};
+    PayloadEncodeMic(frame, 9, &payload, 1, &aes, &cmac, DevAddr, 1, 0);
+  }));
+
+  report("encode()", size, bench([&]() {
+    packet.clear();
+    packet.write(work, size);
+    packet.encode();
+  }));
+
+  // downlink on port 1 with FCnt 0, FCntDown is rewound before each decode
+  uint8_t len = 0;
+  frame[len++] = 0x60;
+  frame[len++] = DevAddr[3];
+  frame[len++] = DevAddr[2];
+  frame[len++] = DevAddr[1];
+  frame[len++] = DevAddr[0];
+  frame[len++] = 0x00;
+  frame[len++] = 0x00;
+  frame[len++] = 0x00;
+  frame[len++] = 0x01;
+  memcpy(frame + len, work, size);
+  PayloadEncode(frame + len, size, AppSKey, DevAddr, 0, 1);
+  len += size;
+  len += PayloadComputeMic(frame, len, NwkSKey, 0, 1);
+
+  int16_t port = 0;
+  report("decode()", size, bench([&]() {
+    packet.Session.FCntDown = 0;
+    packet.clear();
+    packet.write(frame, len);
+    port = packet.decode();
+  }));
+
+  report("decode() view", size, bench([&]() {
+    packet.Session.FCntDown = 0;
+    memcpy(work, frame, len);
+    packet.decode(work, len, &view);
+  }));
+
+  if (port != 1)
+    printf("decode() failed for %d bytes\n", size);
+  if (view.Status != LORAWAN_OK || view.PayloadLen != size)
+    printf("decode() view failed for %d bytes\n", size);
+}
+
+int main(int argc, char **argv)
+{
+  static const int sizes[] = {1, 16, 51, 115, 222, 242};
+  bool all = (argc > 1 && strcmp(argv[1], "all") == 0);
+
+  // headroom and the largest frame, a 242 byte payload with its header and MIC
+  LoRaWanPacketSized<LORAWAN_HEADROOM + 255> packet;
+  packet.debug = 0;
+  packet.setPort(1);
+  SessionSetKeys(&packet.Session, DevAddr, NwkSKey, AppSKey);
+
+  printf("LoRaWanPacket benchmark, AES %s, %d blocks per pass\n", backend(), AES_PARALLEL_BLOCKS);
+  printf("%-28s %5s %12s %12s\n", "operation", "bytes", "ns/op", "MB/s");
+
+  benchKeys();
+
+  if (all)
+  {
+    for (int size = 1; size <= BENCH_MAX_PAYLOAD; size++)
+      benchPayload(packet, size);
+  }
+  else
+  {
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+      benchPayload(packet, sizes[i]);
+  }
+  return 0;
+}
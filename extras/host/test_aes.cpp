@@ -0,0 +1,198 @@
+// ----------------------------------------------- //
+// test_aes.cpp
+// ----------------------------------------------- //
+//
+// Known answer tests of the AES backend the build
+// selected and of the CMAC on top of it: FIPS-197,
+// SP 800-38A ECB and RFC 4493 vectors. make test
+// builds it once per backend.
+//
+// ----------------------------------------------- //
+
+#include <Arduino.h>
+#include "crypto/LoRaMacCrypto.h"
+
+static uint32_t Failures = 0;
+
+static void check(const char *what, const uint8_t *out, const uint8_t *expected, uint16_t len)
+{
+  if (memcmp(out, expected, len) == 0)
+    return;
+  Failures++;
+  printf("FAIL %s\n  got      ", what);
+  for (uint16_t i = 0; i < len; i++)
+    printf("%02x", out[i]);
+  printf("\n  expected ");
+  for (uint16_t i = 0; i < len; i++)
+    printf("%02x", expected[i]);
+  printf("\n");
+}
+
+// FIPS-197 appendix C.1
+static uint8_t KeyC1[16] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
+static const uint8_t PlainC1[16] = {0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff};
+static const uint8_t CipherC1[16] = {0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a};
+
+// FIPS-197 appendix B, also the key of SP 800-38A and RFC 4493
+static uint8_t KeyB[16] = {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
+static const uint8_t PlainB[16] = {0x32, 0x43, 0xf6, 0xa8, 0x88, 0x5a, 0x30, 0x8d, 0x31, 0x31, 0x98, 0xa2, 0xe0, 0x37, 0x07, 0x34};
+static const uint8_t CipherB[16] = {0x39, 0x25, 0x84, 0x1d, 0x02, 0xdc, 0x09, 0xfb, 0xdc, 0x11, 0x85, 0x97, 0x19, 0x6a, 0x0b, 0x32};
+
+// SP 800-38A F.1.1 ECB-AES128, the message of RFC 4493
+static const uint8_t Message[64] = {
+  0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+  0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+  0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+  0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10};
+static const uint8_t MessageECB[64] = {
+  0x3a, 0xd7, 0x7b, 0xb4, 0x0d, 0x7a, 0x36, 0x60, 0xa8, 0x9e, 0xca, 0xf3, 0x24, 0x66, 0xef, 0x97,
+  0xf5, 0xd3, 0xd5, 0x85, 0x03, 0xb9, 0x69, 0x9d, 0xe7, 0x85, 0x89, 0x5a, 0x96, 0xfd, 0xba, 0xaf,
+  0x43, 0xb1, 0xcd, 0x7f, 0x59, 0x8e, 0xce, 0x23, 0x88, 0x1b, 0x00, 0xe3, 0xed, 0x03, 0x06, 0x88,
+  0x7b, 0x0c, 0x78, 0x5e, 0x27, 0xe8, 0xad, 0x3f, 0x82, 0x23, 0x20, 0x71, 0x04, 0x72, 0x5d, 0xd4};
+
+// RFC 4493 section 4
+static const uint8_t K1[16] = {0xfb, 0xee, 0xd6, 0x18, 0x35, 0x71, 0x33, 0x66, 0x7c, 0x85, 0xe0, 0x8f, 0x72, 0x36, 0xa8, 0xde};
+static const uint8_t K2[16] = {0xf7, 0xdd, 0xac, 0x30, 0x6a, 0xe2, 0x66, 0xcc, 0xf9, 0x0b, 0xc1, 0x1e, 0xe4, 0x6d, 0x51, 0x3b};
+static const struct {
+  uint16_t Length;
+  uint8_t Mac[16];
+} Cmac[] = {
+  {0, {0xbb, 0x1d, 0x69, 0x29, 0xe9, 0x59, 0x37, 0x28, 0x7f, 0xa3, 0x7d, 0x12, 0x9b, 0x75, 0x67, 0x46}},
+  {16, {0x07, 0x0a, 0x16, 0xb4, 0x6b, 0x4d, 0x41, 0x44, 0xf7, 0x9b, 0xdd, 0x9d, 0xd0, 0x4a, 0x28, 0x7c}},
+  {40, {0xdf, 0xa6, 0x67, 0x47, 0xde, 0x9a, 0xe6, 0x30, 0x30, 0xca, 0x32, 0x61, 0x14, 0x97, 0xc8, 0x27}},
+  {64, {0x51, 0xf0, 0xbe, 0xbf, 0x7e, 0x3b, 0x9d, 0x92, 0xfc, 0x49, 0x74, 0x17, 0x79, 0x36, 0x3c, 0xfe}},
+};
+
+static const char *backend()
+{
+#if defined(AES_USE_AESNI)
+  if (AES_NI_Supported())
+    return "AES-NI";
+#endif
+#if defined(AES_USE_BITSLICE)
+  return "bitsliced";
+#elif defined(AES_USE_TTABLE)
+  return "T-table";
+#else
+  return "byte";
+#endif
+}
+
+static void testBlock(const char *name, uint8_t *key, const uint8_t *plain, const uint8_t *cipher)
+{
+  AES_Context aes;
+  uint8_t block[16];
+  char what[64];
+
+  memcpy(block, plain, 16);
+  AES_Encrypt(block, key);
+  snprintf(what, sizeof(what), "%s AES_Encrypt (key)", name);
+  check(what, block, cipher, 16);
+
+  AES_Expand_Key(&aes, key);
+  memcpy(block, plain, 16);
+  AES_Encrypt(block, &aes);
+  snprintf(what, sizeof(what), "%s AES_Encrypt (context)", name);
+  check(what, block, cipher, 16);
+
+#if defined(AES_USE_AESNI)
+  if (AES_NI_Supported())
+  {
+    memcpy(block, plain, 16);
+    AES_NI_Encrypt(block, &aes);
+    snprintf(what, sizeof(what), "%s AES_NI_Encrypt", name);
+    check(what, block, cipher, 16);
+  }
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// The 4 ECB blocks repeated, every count from 1 to 20 blocks so the full and
+// the short passes of each multi-block backend are covered.
+// ----------------------------------------------------------------------------
+static void testBlocks()
+{
+  AES_Context aes;
+  uint8_t data[16 * 20];
+  uint8_t expected[16 * 20];
+  char what[64];
+
+  AES_Expand_Key(&aes, KeyB);
+  for (uint8_t i = 0; i < 20; i++)
+    memcpy(expected + (16 * i), MessageECB + (16 * (i % 4)), 16);
+
+  for (uint8_t n = 1; n <= 20; n++)
+  {
+    for (uint8_t i = 0; i < n; i++)
+      memcpy(data + (16 * i), Message + (16 * (i % 4)), 16);
+    AES_Encrypt_Blocks(data, n, &aes);
+    snprintf(what, sizeof(what), "AES_Encrypt_Blocks %d blocks", n);
+    check(what, data, expected, 16 * n);
+
+#if defined(AES_USE_AESNI)
+    if (AES_NI_Supported())
+    {
+      for (uint8_t i = 0; i < n; i++)
+        memcpy(data + (16 * i), Message + (16 * (i % 4)), 16);
+      AES_NI_Encrypt_Blocks(data, n, &aes);
+      snprintf(what, sizeof(what), "AES_NI_Encrypt_Blocks %d blocks", n);
+      check(what, data, expected, 16 * n);
+    }
+#endif
+
+#if defined(AES_USE_BITSLICE)
+    for (uint8_t i = 0; i < n; i++)
+      memcpy(data + (16 * i), Message + (16 * (i % 4)), 16);
+    AES_Bitslice_Encrypt_Blocks(data, n, &aes);
+    snprintf(what, sizeof(what), "AES_Bitslice_Encrypt_Blocks %d blocks", n);
+    check(what, data, expected, 16 * n);
+#endif
+  }
+}
+
+static void testCmac()
+{
+  CMAC_Key cmac;
+  CMAC_Context ctx;
+  uint8_t mac[16];
+  char what[64];
+
+  generate_cmac_key(&cmac, KeyB);
+  check("CMAC K1", cmac.K1, K1, 16);
+  check("CMAC K2", cmac.K2, K2, 16);
+
+  for (uint8_t v = 0; v < sizeof(Cmac) / sizeof(Cmac[0]); v++)
+  {
+    CMAC_Init(&ctx, &cmac);
+    CMAC_Update(&ctx, Message, Cmac[v].Length);
+    CMAC_Final(&ctx, mac);
+    snprintf(what, sizeof(what), "CMAC %d bytes", Cmac[v].Length);
+    check(what, mac, Cmac[v].Mac, 16);
+
+    // the same message in pieces of every size
+    for (uint8_t piece = 1; piece < 20; piece++)
+    {
+      CMAC_Init(&ctx, &cmac);
+      for (uint16_t i = 0; i < Cmac[v].Length; i += piece)
+        CMAC_Update(&ctx, Message + i, (Cmac[v].Length - i < piece) ? Cmac[v].Length - i : piece);
+      CMAC_Final(&ctx, mac);
+      snprintf(what, sizeof(what), "CMAC %d bytes in pieces of %d", Cmac[v].Length, piece);
+      check(what, mac, Cmac[v].Mac, 16);
+    }
+  }
+}
+
+int main()
+{
+  printf("AES %s, %d blocks per pass\n", backend(), AES_PARALLEL_BLOCKS);
+
+  testBlock("FIPS-197 C.1", KeyC1, PlainC1, CipherC1);
+  testBlock("FIPS-197 B", KeyB, PlainB, CipherB);
+  for (uint8_t i = 0; i < 4; i++)
+    testBlock("SP 800-38A ECB", KeyB, Message + (16 * i), MessageECB + (16 * i));
+  testBlocks();
+  testCmac();
+
+  printf("%s\n", Failures ? "FAIL" : "ok");
+  return Failures ? 1 : 0;
+}
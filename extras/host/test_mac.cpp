@@ -0,0 +1,388 @@
+// ----------------------------------------------- //
+// test_mac.cpp
+// ----------------------------------------------- //
+//
+// The single pass parser of downlink MAC commands,
+// and the queue of uplink MAC answers: release by
+// the application, coalescing, a full queue, and how
+// encode() spreads it over FOpts and port 0.
+//
+// ----------------------------------------------- //
+
+#include <Arduino.h>
+#include <stddef.h>
+#include "LoRaWanPacket.h"
+
+static uint8_t DevAddr[4] = {0x26, 0x01, 0x1B, 0xDA};
+static uint8_t NwkSKey[16] = {0x2B, 0x7E, 0x15, 0x16, 0x28, 0xAE, 0xD2, 0xA6, 0xAB, 0xF7, 0x15, 0x88, 0x09, 0xCF, 0x4F, 0x3C};
+static uint8_t AppSKey[16] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F};
+
+// Requests with the fields of the examples of the LoRaWAN 1.0.x specification
+static const uint8_t LinkADRReq[] = {0x03, 0x52, 0xFF, 0x00, 0x01};
+static const uint8_t RXParamSetupReq[] = {0x05, 0x12, 0x18, 0x4F, 0x84};
+static const uint8_t DevStatusReq[] = {0x06};
+static const uint8_t NewChannelReq[] = {0x07, 0x03, 0x18, 0x4F, 0x84, 0x50};
+
+static uint32_t Failures = 0;
+
+static void check(const char *what, const uint8_t *out, uint8_t len, const uint8_t *expected, uint8_t expectedLen)
+{
+  if (len == expectedLen && (len == 0 || memcmp(out, expected, len) == 0))
+    return;
+  Failures++;
+  printf("FAIL %s\n  got      ", what);
+  for (uint8_t i = 0; i < len; i++)
+    printf("%02X", out[i]);
+  printf("\n  expected ");
+  for (uint8_t i = 0; i < expectedLen; i++)
+    printf("%02X", expected[i]);
+  printf("\n");
+}
+
+// ----------------------------------------------------------------------------
+// Encodes one uplink and decodes it back; the MAC commands it carries, from
+// FOpts or the port 0 payload, are copied to mac.
+// ----------------------------------------------------------------------------
+static uint8_t uplink(LoRaWanPacketClass &packet, LoRaWanSession *network, uint8_t payload, uint8_t *mac, uint8_t *port)
+{
+  uint8_t frame[256];
+  LoRaWanView view;
+
+  packet.clear();
+  for (uint8_t i = 0; i < payload; i++)
+    packet.write(i);
+  packet.encode();
+  uint8_t len = packet.length();
+  memcpy(frame, packet.buffer(), len);
+  if (SessionDecode(network, frame, len, &view) != LORAWAN_OK)
+  {
+    Failures++;
+    printf("FAIL uplink not decoded\n");
+    return 0;
+  }
+
+  *port = (view.FPort) ? frame[view.FPort] : 255;
+  if (*port == 0)
+  {
+    memcpy(mac, frame + view.Payload, view.PayloadLen);
+    return view.PayloadLen;
+  }
+  memcpy(mac, frame + view.FOpts, view.FOptsLen);
+  return view.FOptsLen;
+}
+
+// ----------------------------------------------------------------------------
+// One command per CID, the fields it sets on a cleared LoRaWanMac
+// ----------------------------------------------------------------------------
+static void expectLinkCheckAns(LoRaWanMac *mac) { mac->Margin = 20; mac->GwCnt = 3; }
+static void expectLinkADRReq(LoRaWanMac *mac) { mac->DataRate = 5; mac->TxPower = 2; mac->ChMask = 0x01FF; mac->ChMaskCntl = 6; mac->NbTrans = 3; }
+static void expectDutyCycleReq(LoRaWanMac *mac) { mac->MaxDutyCycle = 3; }
+static void expectRXParamSetupReq(LoRaWanMac *mac) { mac->RX1DROffset = 1; mac->RX2DataRate = 2; mac->RX2Frequency = 867100000; }
+static void expectNewChannelReq(LoRaWanMac *mac) { mac->ChIndex = 3; mac->ChFrequency = 867100000; mac->ChMinDR = 0; mac->ChMaxDR = 5; }
+static void expectRXTimingSetupReq(LoRaWanMac *mac) { mac->RXDelay = 5; }
+static void expectRXTimingSetupReq0(LoRaWanMac *mac) { mac->RXDelay = 1; }
+
+static const struct {
+  const char *Name;
+  uint8_t Command[8];
+  uint8_t Length;             // bytes of Command, the CID included
+  uint8_t Parsed;             // what MacCommand() returns
+  void (*Expect)(LoRaWanMac *mac);
+} Commands[] = {
+  {"LinkCheckAns", {0x02, 20, 3}, 3, 3, expectLinkCheckAns},
+  {"LinkADRReq", {0x03, 0x52, 0xFF, 0x01, 0x63}, 5, 5, expectLinkADRReq},
+  {"DutyCycleReq", {0x04, 0xF3}, 2, 2, expectDutyCycleReq},
+  {"RXParamSetupReq", {0x05, 0x12, 0x18, 0x4F, 0x84}, 5, 5, expectRXParamSetupReq},
+  {"DevStatusReq", {0x06}, 1, 1, NULL},
+  {"NewChannelReq", {0x07, 0x03, 0x18, 0x4F, 0x84, 0x50}, 6, 6, expectNewChannelReq},
+  {"RXTimingSetupReq", {0x08, 0x05}, 2, 2, expectRXTimingSetupReq},
+  {"RXTimingSetupReq 0", {0x08, 0x00}, 2, 2, expectRXTimingSetupReq0},
+  {"TxParamSetupReq", {0x09, 0x05}, 2, 2, NULL},
+  {"DlChannelReq", {0x0A, 0x03, 0x18, 0x4F, 0x84}, 5, 5, NULL},
+  // the rest of a frame cannot be walked past these
+  {"LinkADRReq truncated", {0x03, 0x52, 0xFF, 0x01}, 4, 0, NULL},
+  {"NewChannelReq truncated", {0x07, 0x03}, 2, 0, NULL},
+  {"CID 0x01", {0x01, 0x00}, 2, 0, NULL},
+  {"CID 0x0B", {0x0B, 0x00}, 2, 0, NULL},
+  {"CID 0x80", {0x80}, 1, 0, NULL},
+  {"empty", {0x00}, 0, 0, NULL},
+};
+
+static void testParse()
+{
+  LoRaWanMac mac, expected;
+
+  for (uint8_t c = 0; c < sizeof(Commands) / sizeof(Commands[0]); c++)
+  {
+    MacClear(&mac);
+    MacClear(&expected);
+    if (Commands[c].Expect)
+      Commands[c].Expect(&expected);
+    if (Commands[c].Parsed)
+      expected.Received = MCMD_BIT(Commands[c].Command[0]);
+
+    uint8_t n = MacCommand(&mac, Commands[c].Command, Commands[c].Length);
+    if (n != Commands[c].Parsed || memcmp(&mac, &expected, offsetof(LoRaWanMac, Queue)))
+    {
+      Failures++;
+      printf("FAIL %s, %d bytes parsed\n", Commands[c].Name, n);
+    }
+  }
+}
+
+// ----------------------------------------------------------------------------
+// Downlink with MAC commands in FOpts, or on port 0 encrypted with the NwkSKey
+// ----------------------------------------------------------------------------
+static uint8_t downlink(uint8_t *frame, uint16_t fcnt, const uint8_t *fopts, uint8_t foptsLen, const uint8_t *mac, uint8_t macLen)
+{
+  uint8_t len = 0;
+  frame[len++] = 0x60;
+  frame[len++] = DevAddr[3];
+  frame[len++] = DevAddr[2];
+  frame[len++] = DevAddr[1];
+  frame[len++] = DevAddr[0];
+  frame[len++] = foptsLen;
+  frame[len++] = fcnt & 0xFF;
+  frame[len++] = fcnt >> 8;
+  memcpy(frame + len, fopts, foptsLen);
+  len += foptsLen;
+  if (macLen)
+  {
+    frame[len++] = 0x00;
+    memcpy(frame + len, mac, macLen);
+    PayloadEncode(frame + len, macLen, NwkSKey, DevAddr, fcnt, 1);
+    len += macLen;
+  }
+  len += PayloadComputeMic(frame, len, NwkSKey, fcnt, 1);
+  return len;
+}
+
+// ----------------------------------------------------------------------------
+// Whole frames through decode(): the walk stops at an unknown CID or a
+// truncated command, the commands before it are kept.
+// ----------------------------------------------------------------------------
+static void testFrames()
+{
+  LoRaWanPacketClass packet;
+  packet.debug = 0;
+  SessionSetKeys(&packet.Session, DevAddr, NwkSKey, AppSKey);
+  uint8_t frame[64];
+  uint8_t len;
+
+  static const uint8_t fopts[] = {0x02, 20, 3, 0x04, 0xF3, 0x30, 0x06};
+  len = downlink(frame, 1, fopts, sizeof(fopts), NULL, 0);
+  packet.clear();
+  packet.write(frame, len);
+  packet.decode();
+  if (packet.Mac.Received != (MCMD_BIT(0x02) | MCMD_BIT(0x04)) || packet.Mac.GwCnt != 3 || packet.Mac.MaxDutyCycle != 3)
+  {
+    Failures++;
+    printf("FAIL FOpts with an unknown CID, Received %04X\n", packet.Mac.Received);
+  }
+
+  static const uint8_t port0[] = {0x05, 0x12, 0x18, 0x4F, 0x84, 0x07, 0x03, 0x18, 0x4F, 0x84, 0x50, 0x03, 0x52, 0xFF, 0x01, 0x63, 0x08};
+  len = downlink(frame, 2, NULL, 0, port0, sizeof(port0));
+  packet.clear();
+  packet.write(frame, len);
+  if (packet.decode() != 0 || packet.Mac.Received != (MCMD_BIT(0x03) | MCMD_BIT(0x05) | MCMD_BIT(0x07)) ||
+      packet.Mac.RX2Frequency != 867100000 || packet.Mac.ChMaxDR != 5 || packet.Mac.NbTrans != 3 || packet.Mac.RXDelay != 0)
+  {
+    Failures++;
+    printf("FAIL port 0 with a truncated command, Received %04X\n", packet.Mac.Received);
+  }
+}
+
+// ----------------------------------------------------------------------------
+// The answers of settings wait for MacAnswer(), which keeps only the ACK bits
+// each answer has.
+// ----------------------------------------------------------------------------
+static void testAnswer()
+{
+  LoRaWanMac mac;
+  MacClear(&mac);
+
+  MacCommand(&mac, LinkADRReq, sizeof(LinkADRReq));
+  MacCommand(&mac, LinkADRReq, sizeof(LinkADRReq));
+  MacCommand(&mac, NewChannelReq, sizeof(NewChannelReq));
+  if (MacQueueFit(&mac, LORAWAN_MAC_QUEUE) != 0)
+  {
+    Failures++;
+    printf("FAIL answers sent before MacAnswer()\n");
+  }
+
+  uint8_t released = MacAnswer(&mac, MCMD_LINK_ADR_REQ, 0xFF);
+  static const uint8_t adr[] = {0x03, 0x07, 0x03, 0x07};
+  uint8_t n = MacQueueFit(&mac, LORAWAN_MAC_QUEUE);
+  check("LinkADRAns released", mac.Queue, n, adr, sizeof(adr));
+  if (released != 2)
+  {
+    Failures++;
+    printf("FAIL MacAnswer() released %d LinkADRAns\n", released);
+  }
+
+  MacAnswer(&mac, MCMD_NEW_CHANNEL_REQ, 0xFE);
+  static const uint8_t all[] = {0x03, 0x07, 0x03, 0x07, 0x07, 0x02};
+  n = MacQueueFit(&mac, LORAWAN_MAC_QUEUE);
+  check("NewChannelAns masked", mac.Queue, n, all, sizeof(all));
+
+  // nothing left to release
+  if (MacAnswer(&mac, MCMD_NEW_CHANNEL_REQ, 0xFF) != 0 || MacAnswer(&mac, 0x40, 0xFF) != 0)
+  {
+    Failures++;
+    printf("FAIL MacAnswer() with nothing waiting\n");
+  }
+}
+
+// ----------------------------------------------------------------------------
+// A Single answer replaces the older one still queued, the others stack up
+// until the queue is full.
+// ----------------------------------------------------------------------------
+static void testQueue()
+{
+  LoRaWanMac mac;
+  MacClear(&mac);
+
+  mac.Battery = 100;
+  mac.Snr = 5;
+  MacCommand(&mac, DevStatusReq, sizeof(DevStatusReq));
+  mac.Battery = 90;
+  mac.Snr = -40;
+  MacCommand(&mac, DevStatusReq, sizeof(DevStatusReq));
+  MacCommand(&mac, RXParamSetupReq, sizeof(RXParamSetupReq));
+  MacCommand(&mac, RXParamSetupReq, sizeof(RXParamSetupReq));
+  MacAccept(&mac);
+  static const uint8_t single[] = {0x06, 90, 0x20, 0x05, 0x07};
+  check("Single answers", mac.Queue, mac.QueueLen, single, sizeof(single));
+
+  // LinkCheckReq is Single as well
+  MacQueue(&mac, MCMD_LINK_CHECK_REQ, NULL, 0);
+  MacQueue(&mac, MCMD_LINK_CHECK_REQ, NULL, 0);
+  if (mac.QueueLen != sizeof(single) + 1)
+  {
+    Failures++;
+    printf("FAIL LinkCheckReq queued twice\n");
+  }
+
+  // 2 bytes per LinkADRAns until the queue is full
+  uint8_t room = (LORAWAN_MAC_QUEUE - mac.QueueLen) / 2;
+  for (uint8_t i = 0; i < room; i++)
+    MacCommand(&mac, LinkADRReq, sizeof(LinkADRReq));
+  uint8_t full = mac.QueueLen;
+  MacCommand(&mac, LinkADRReq, sizeof(LinkADRReq));
+  if (mac.QueueLen != full || MacQueue(&mac, MCMD_LINK_ADR_ANS, single, 1) || full + 2 <= LORAWAN_MAC_QUEUE)
+  {
+    Failures++;
+    printf("FAIL full queue, %d bytes\n", mac.QueueLen);
+  }
+
+  // a field of the wrong length is refused
+  if (MacQueue(&mac, MCMD_LINK_CHECK_REQ, single, 1))
+  {
+    Failures++;
+    printf("FAIL LinkCheckReq with a field\n");
+  }
+
+  // whole commands only
+  MacAccept(&mac);
+  uint8_t n = MacQueueFit(&mac, 5);
+  MacQueueDrop(&mac, n);
+  if (n != 5 || mac.Queue[0] != MCMD_LINK_CHECK_REQ || mac.QueueLen != full - 5)
+  {
+    Failures++;
+    printf("FAIL MacQueueFit() and MacQueueDrop(), %d bytes\n", n);
+  }
+}
+
+// ----------------------------------------------------------------------------
+// encode() puts the answers in FOpts, 15 bytes of whole commands, or on
+// port 0 when there is no payload and they do not fit there.
+// ----------------------------------------------------------------------------
+static void testEncode()
+{
+  LoRaWanPacketClass packet;
+  packet.debug = 0;
+  packet.setPort(1);
+  SessionSetKeys(&packet.Session, DevAddr, NwkSKey, AppSKey);
+  LoRaWanSession network = packet.Session;
+  uint8_t mac[256];
+  uint8_t port;
+
+  // 11 LinkADRAns, 22 bytes
+  for (uint8_t i = 0; i < 11; i++)
+    MacCommand(&packet.Mac, LinkADRReq, sizeof(LinkADRReq));
+
+  // with a payload, 7 in FOpts and the rest in the next uplink
+  static const uint8_t adr[] = {0x03, 0x07, 0x03, 0x07, 0x03, 0x07, 0x03, 0x07, 0x03, 0x07, 0x03, 0x07, 0x03, 0x07};
+  uint8_t n = uplink(packet, &network, 4, mac, &port);
+  check("FOpts", mac, n, adr, sizeof(adr));
+  n = uplink(packet, &network, 4, mac, &port);
+  check("FOpts, the rest", mac, n, adr, 8);
+
+  // without a payload, all of them on port 0
+  for (uint8_t i = 0; i < 11; i++)
+    MacCommand(&packet.Mac, LinkADRReq, sizeof(LinkADRReq));
+  n = uplink(packet, &network, 0, mac, &port);
+  if (port != 0 || n != 22 || memcmp(mac, adr, 14) || packet.Mac.QueueLen != 0)
+  {
+    Failures++;
+    printf("FAIL port 0, port %d, %d bytes\n", port, n);
+  }
+}
+
+// ----------------------------------------------------------------------------
+// With Hold, an answer the application has not confirmed stays queued and the
+// answers behind it still go out.
+// ----------------------------------------------------------------------------
+static void testHold()
+{
+  LoRaWanPacketClass packet;
+  packet.debug = 0;
+  packet.setPort(1);
+  SessionSetKeys(&packet.Session, DevAddr, NwkSKey, AppSKey);
+  LoRaWanSession network = packet.Session;
+  uint8_t mac[256];
+  uint8_t port;
+
+  packet.Mac.Hold = true;
+  packet.Mac.Battery = 255;
+  MacCommand(&packet.Mac, LinkADRReq, sizeof(LinkADRReq));
+  MacCommand(&packet.Mac, DevStatusReq, sizeof(DevStatusReq));
+
+  static const uint8_t status[] = {0x06, 0xFF, 0x00};
+  uint8_t n = uplink(packet, &network, 1, mac, &port);
+  check("DevStatusAns behind a held answer", mac, n, status, sizeof(status));
+  n = uplink(packet, &network, 1, mac, &port);
+  check("held answer", mac, n, NULL, 0);
+  if (packet.Mac.QueueLen != 2)
+  {
+    Failures++;
+    printf("FAIL held answer dropped\n");
+  }
+
+  MacAnswer(&packet.Mac, MCMD_LINK_ADR_REQ, 0x06);
+  static const uint8_t adr[] = {0x03, 0x06};
+  n = uplink(packet, &network, 1, mac, &port);
+  check("answer after MacAnswer()", mac, n, adr, sizeof(adr));
+
+  // without Hold encode() accepts what was not answered
+  packet.Mac.Hold = false;
+  MacCommand(&packet.Mac, LinkADRReq, sizeof(LinkADRReq));
+  static const uint8_t accepted[] = {0x03, 0x07};
+  n = uplink(packet, &network, 1, mac, &port);
+  check("answer accepted by encode()", mac, n, accepted, sizeof(accepted));
+}
+
+int main()
+{
+  testParse();
+  testFrames();
+  printf("%-16s %s\n", "commands", Failures ? "FAIL" : "ok");
+  testAnswer();
+  testQueue();
+  printf("%-16s %s\n", "answer queue", Failures ? "FAIL" : "ok");
+  testEncode();
+  testHold();
+  printf("%-16s %s\n", "answers encoded", Failures ? "FAIL" : "ok");
+
+  return Failures ? 1 : 0;
+}
@@ -0,0 +1,367 @@
+// ----------------------------------------------- //
+// test_packet.cpp
+// ----------------------------------------------- //
+//
+// Round trips through the default LoRaWanPacketClass
+// buffer up to the largest frame it takes: downlinks
+// written and decoded, uplinks encoded and decoded
+// back by a session with the same keys, the same
+// uplinks from fragments and from encodeFixed(),
+// and an uplink received back. Built with
+// LORAWAN_KEYSTREAM_FRAMES, the uplinks encrypted
+// with the precomputed keystream too.
+//
+// ----------------------------------------------- //
+
+#include <Arduino.h>
+#include "LoRaWanPacket.h"
+
+static uint8_t DevAddr[4] = {0x26, 0x01, 0x1B, 0xDA};
+static uint8_t NwkSKey[16] = {0x2B, 0x7E, 0x15, 0x16, 0x28, 0xAE, 0xD2, 0xA6, 0xAB, 0xF7, 0x15, 0x88, 0x09, 0xCF, 0x4F, 0x3C};
+static uint8_t AppSKey[16] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F};
+
+static uint32_t Failures = 0;
+
+static void fail(const char *what, int size)
+{
+  if (Failures++ < 10)
+    printf("FAIL %s, %d bytes\n", what, size);
+}
+
+// ----------------------------------------------------------------------------
+// Unconfirmed downlink on port 1, MHDR, FHDR and FPort take 9 bytes
+// ----------------------------------------------------------------------------
+static uint8_t downlink(uint8_t *frame, uint16_t fcnt, uint8_t size)
+{
+  uint8_t len = 0;
+  frame[len++] = 0x60;
+  frame[len++] = DevAddr[3];
+  frame[len++] = DevAddr[2];
+  frame[len++] = DevAddr[1];
+  frame[len++] = DevAddr[0];
+  frame[len++] = 0x00;
+  frame[len++] = fcnt & 0xFF;
+  frame[len++] = fcnt >> 8;
+  frame[len++] = 0x01;
+  for (uint8_t i = 0; i < size; i++)
+    frame[len + i] = (uint8_t)(i * 7 + size);
+  PayloadEncode(frame + len, size, AppSKey, DevAddr, fcnt, 1);
+  len += size;
+  len += PayloadComputeMic(frame, len, NwkSKey, fcnt, 1);
+  return len;
+}
+
+// ----------------------------------------------------------------------------
+// Every downlink payload up to a frame the size of the buffer, written a byte
+// at a time and at once.
+// ----------------------------------------------------------------------------
+static void testDecode(LoRaWanPacketClass &packet)
+{
+  uint8_t frame[256];
+  uint16_t fcnt = 0;
+
+  for (uint8_t size = 1; 9 + size + 4 <= LORAWAN_BUF_SIZE; size++)
+  {
+    for (int bytewise = 0; bytewise < 2; bytewise++)
+    {
+      uint8_t len = downlink(frame, ++fcnt, size);
+      packet.clear();
+      if (bytewise)
+        for (uint8_t i = 0; i < len; i++)
+          packet.write(frame[i]);
+      else
+        packet.write(frame, len);
+
+      if (packet.decode() != 1 || packet.length() != size)
+      {
+        fail(bytewise ? "decode() written bytewise" : "decode()", size);
+        continue;
+      }
+      for (uint8_t i = 0; i < size; i++)
+      {
+        if (packet.read() != (uint8_t)(i * 7 + size))
+        {
+          fail("decode() payload", size);
+          break;
+        }
+      }
+    }
+  }
+
+  // a frame one byte longer than the buffer is cut
+  uint8_t size = LORAWAN_BUF_SIZE - 9 - 4 + 1;
+  uint8_t len = downlink(frame, ++fcnt, size);
+  packet.clear();
+  if (packet.write(frame, len) == len || packet.decode() == 1)
+    fail("decode() of a frame longer than the buffer", size);
+}
+
+// ----------------------------------------------------------------------------
+// Every uplink payload encode() takes, then the first one it refuses.
+// ----------------------------------------------------------------------------
+static void testEncode(LoRaWanPacketClass &packet)
+{
+  LoRaWanSession network = packet.Session;
+  LoRaWanView view;
+  uint8_t frame[256];
+  const int largest = LORAWAN_BUF_SIZE - LORAWAN_HEADROOM - 4;
+
+  for (int size = 0; size <= largest; size++)
+  {
+    packet.clear();
+    for (int i = 0; i < size; i++)
+      packet.write((uint8_t)(i * 3 + size));
+    if (packet.encode() != 1)
+    {
+      fail("encode()", size);
+      continue;
+    }
+
+    uint8_t len = packet.length();
+    memcpy(frame, packet.buffer(), len);
+    if (SessionDecode(&network, frame, len, &view) != LORAWAN_OK || view.PayloadLen != size)
+    {
+      fail("encode() decoded", size);
+      continue;
+    }
+    for (int i = 0; i < size; i++)
+    {
+      if (frame[view.Payload + i] != (uint8_t)(i * 3 + size))
+      {
+        fail("encode() payload", size);
+        break;
+      }
+    }
+  }
+
+  packet.clear();
+  for (int i = 0; i <= largest; i++)
+    packet.write((uint8_t)i);
+  if (packet.encode() != 0)
+    fail("encode() of a payload longer than the buffer", largest + 1);
+}
+
+// ----------------------------------------------------------------------------
+// Checks the uplink of len bytes in frame against the one encode() gave for
+// the same payload and counter, then decodes it and checks the payload.
+// ----------------------------------------------------------------------------
+static void roundTrip(const char *what, LoRaWanSession *network, uint8_t *frame, uint8_t len, const uint8_t *expected, uint8_t expectedLen, const uint8_t *payload, uint8_t size)
+{
+  LoRaWanView view;
+
+  if (len != expectedLen || memcmp(frame, expected, len))
+    fail(what, size);
+  else if (SessionDecode(network, frame, len, &view) != LORAWAN_OK || view.PayloadLen != size || memcmp(frame + view.Payload, payload, size))
+    fail(what, size);
+}
+
+// ----------------------------------------------------------------------------
+// A payload split into 1 to 4 fragments, empty ones among them, gives the
+// frame encode() gives for it written at once.
+// ----------------------------------------------------------------------------
+static void testFragments(LoRaWanPacketClass &packet)
+{
+  LoRaWanSession network = packet.Session;
+  Payload_Fragment fragments[4];
+  uint8_t payload[64];
+  uint8_t expected[256];
+
+  for (uint8_t i = 0; i < sizeof(payload); i++)
+    payload[i] = (uint8_t)(i * 5 + 1);
+
+  for (uint8_t size = 0; size <= sizeof(payload); size++)
+  {
+    for (uint8_t num = 1; num <= 4; num++)
+    {
+      for (uint8_t f = 0; f < num; f++)
+      {
+        fragments[f].Data = payload + size * f / num;
+        fragments[f].Length = size * (f + 1) / num - size * f / num;
+      }
+
+      uint32_t count = packet.Session.FCntUp;
+      packet.clear();
+      packet.write(payload, size);
+      packet.encode();
+      uint8_t expectedLen = packet.length();
+      memcpy(expected, packet.buffer(), expectedLen);
+
+      packet.Session.FCntUp = count;
+      if (packet.encode(fragments, num) != 1)
+      {
+        fail("encode() of fragments", size);
+        continue;
+      }
+      roundTrip("encode() of fragments", &network, packet.buffer(), packet.length(), expected, expectedLen, payload, size);
+    }
+  }
+
+  // written bytes are dropped, the fragments are the whole payload
+  packet.clear();
+  packet.write(payload, 8);
+  fragments[0].Data = payload + 8;
+  fragments[0].Length = 8;
+  if (packet.encode(fragments, 1) != 1)
+    fail("encode() of fragments after write()", 8);
+  else
+    roundTrip("encode() of fragments after write()", &network, packet.buffer(), packet.length(), packet.buffer(), packet.length(), payload + 8, 8);
+}
+
+// ----------------------------------------------------------------------------
+// encodeFixed() gives the frame encode() gives for SIZE bytes on the same
+// port, and refuses one byte less or more.
+// ----------------------------------------------------------------------------
+template <uint8_t SIZE, bool MAC_PORT>
+static void fixed(LoRaWanPacketClass &packet, LoRaWanSession *network)
+{
+  uint8_t payload[SIZE + 1];
+  uint8_t expected[256];
+
+  for (uint8_t i = 0; i <= SIZE; i++)
+    payload[i] = (uint8_t)(i * 11 + SIZE);
+  packet.setPort(MAC_PORT ? 0 : 1);
+
+  uint32_t count = packet.Session.FCntUp;
+  packet.clear();
+  packet.write(payload, SIZE);
+  packet.encode();
+  uint8_t expectedLen = packet.length();
+  memcpy(expected, packet.buffer(), expectedLen);
+
+  packet.Session.FCntUp = count;
+  packet.clear();
+  packet.write(payload, SIZE);
+  if (packet.encodeFixed<SIZE, MAC_PORT>() != 1)
+    fail(MAC_PORT ? "encodeFixed() on port 0" : "encodeFixed()", SIZE);
+  else
+    roundTrip(MAC_PORT ? "encodeFixed() on port 0" : "encodeFixed()", network, packet.buffer(), packet.length(), expected, expectedLen, payload, SIZE);
+
+  for (uint8_t size = SIZE - 1; size <= SIZE + 1; size += 2)
+  {
+    count = packet.Session.FCntUp;
+    packet.clear();
+    packet.write(payload, size);
+    if (packet.encodeFixed<SIZE, MAC_PORT>() != 0 || packet.Session.FCntUp != count)
+      fail("encodeFixed() of another size", size);
+  }
+  packet.setPort(1);
+}
+
+static void testFixed(LoRaWanPacketClass &packet)
+{
+  LoRaWanSession network = packet.Session;
+
+  fixed<1, false>(packet, &network);
+  fixed<4, false>(packet, &network);
+  fixed<16, false>(packet, &network);
+  fixed<17, false>(packet, &network);
+  fixed<51, false>(packet, &network);
+  fixed<4, true>(packet, &network);
+  fixed<20, true>(packet, &network);
+}
+
+#if LORAWAN_KEYSTREAM_FRAMES > 0
+// ----------------------------------------------------------------------------
+// Uplinks encrypted with the keystream of precompute(), used up, left behind
+// by a jump of FCntUp or dropped by new keys, give the frames a packet
+// without it gives.
+// ----------------------------------------------------------------------------
+static void testKeystream()
+{
+  static const char *appSKeys[2] = {"000102030405060708090A0B0C0D0E0F", "0F0E0D0C0B0A09080706050403020100"};
+  LoRaWanPacketClass packet, plain;
+  LoRaWanSession network;
+  uint8_t payload[LORAWAN_KEYSTREAM_SIZE + 1];
+  uint8_t expected[256];
+
+  packet.debug = plain.debug = 0;
+  packet.setPort(1);
+  plain.setPort(1);
+  for (uint8_t i = 0; i < sizeof(payload); i++)
+    payload[i] = (uint8_t)(i * 13 + 5);
+
+  for (uint8_t k = 0; k < 2; k++)
+  {
+    packet.personalize("26011BDA", "2B7E151628AED2A6ABF7158809CF4F3C", appSKeys[k]);
+    plain.personalize("26011BDA", "2B7E151628AED2A6ABF7158809CF4F3C", appSKeys[k]);
+    network = packet.Session;
+    if (k == 0)
+      packet.precompute();
+
+    for (uint32_t round = 0; round < 6 * LORAWAN_KEYSTREAM_FRAMES; round++)
+    {
+      uint8_t size = round % sizeof(payload) + 1;
+      if (round % 3 == 0)
+        packet.precompute();
+      if (round == 4 * LORAWAN_KEYSTREAM_FRAMES)
+      {
+        packet.Session.FCntUp += LORAWAN_KEYSTREAM_FRAMES + 1;
+        plain.Session.FCntUp = packet.Session.FCntUp;
+      }
+
+      plain.clear();
+      plain.write(payload, size);
+      plain.encode();
+      uint8_t expectedLen = plain.length();
+      memcpy(expected, plain.buffer(), expectedLen);
+
+      packet.clear();
+      packet.write(payload, size);
+      if (packet.encode() != 1)
+        fail("encode() with the keystream", size);
+      else
+        roundTrip("encode() with the keystream", &network, packet.buffer(), packet.length(), expected, expectedLen, payload, size);
+    }
+  }
+}
+#endif
+
+// ----------------------------------------------------------------------------
+// The node's own uplink, with a MAC answer in FOpts, received back is not a
+// downlink: no port, no MAC command and the queue is left as it was.
+// ----------------------------------------------------------------------------
+static void testEcho(LoRaWanPacketClass &packet)
+{
+  uint8_t frame[256];
+  uint8_t status[2] = {255, 0};
+
+  MacQueue(&packet.Mac, MCMD_DEV_STATUS_ANS, status, 2);
+  packet.clear();
+  packet.write((uint8_t)1);
+  packet.encode();
+  uint8_t len = packet.length();
+  memcpy(frame, packet.buffer(), len);
+  if (frame[5] != 3 || packet.Mac.QueueLen != 0)
+    fail("encode() with DevStatusAns in FOpts", len);
+
+  packet.clear();
+  packet.write(frame, len);
+  if (packet.decode() != 0 || packet.Mac.Received != 0 || packet.Mac.QueueLen != 0)
+    fail("decode() of an uplink", len);
+}
+
+int main()
+{
+  LoRaWanPacketClass packet;
+  packet.debug = 0;
+  packet.setPort(1);
+  SessionSetKeys(&packet.Session, DevAddr, NwkSKey, AppSKey);
+
+  testDecode(packet);
+  printf("%-16s %s\n", "decode", Failures ? "FAIL" : "ok");
+  // the same packet, encode() gets its headroom back after the long frames
+  testEncode(packet);
+  printf("%-16s %s\n", "encode", Failures ? "FAIL" : "ok");
+  testFragments(packet);
+  printf("%-16s %s\n", "fragments", Failures ? "FAIL" : "ok");
+  testFixed(packet);
+  printf("%-16s %s\n", "encodeFixed", Failures ? "FAIL" : "ok");
+  testEcho(packet);
+  printf("%-16s %s\n", "uplink echo", Failures ? "FAIL" : "ok");
+#if LORAWAN_KEYSTREAM_FRAMES > 0
+  testKeystream();
+  printf("%-16s %s\n", "keystream", Failures ? "FAIL" : "ok");
+#endif
+
+  return Failures ? 1 : 0;
+}
@@ -0,0 +1,206 @@
+// ----------------------------------------------- //
+// test_session.cpp
+// ----------------------------------------------- //
+//
+// Frame counters of SessionDecode(): the 32-bit
+// counter rebuilt from the 16 bits sent, and the
+// replay window around it. Removal from the probe
+// chains of LoRaWanSessionTable.
+//
+// ----------------------------------------------- //
+
+#include <Arduino.h>
+#include "LoRaWanSession.h"
+#include "LoRaWanEncoder.h"
+#include "LoRaWanSessionTable.h"
+
+static uint8_t DevAddr[4] = {0x26, 0x01, 0x1B, 0xDA};
+static uint8_t NwkSKey[16] = {0x2B, 0x7E, 0x15, 0x16, 0x28, 0xAE, 0xD2, 0xA6, 0xAB, 0xF7, 0x15, 0x88, 0x09, 0xCF, 0x4F, 0x3C};
+static uint8_t AppSKey[16] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F};
+
+static uint32_t Failures = 0;
+
+static_assert(LORAWAN_REPLAY_WINDOW == 32, "the counters below are laid out for the default window");
+
+static const char *Status[] = {"OK", "JOIN_ACCEPT", "BAD_FRAME", "UNKNOWN_DEVICE", "BAD_MIC", "REPLAY"};
+
+// ----------------------------------------------------------------------------
+// Sends the uplink with frame counter count to the network session, and
+// checks the status it gets.
+// ----------------------------------------------------------------------------
+static void uplink(LoRaWanSession *network, uint32_t count, LoRaWanStatus expected)
+{
+  LoRaWanSession device = *network;
+  LoRaWanView view;
+  uint8_t frame[32];
+  uint8_t payload[4] = {1, 2, 3, 4};
+
+  device.FCntUp = count;
+  uint8_t len = LoRaWanUplink<0, false, 4>::encode(&device, frame, 0, NULL, 1, payload);
+  LoRaWanStatus status = SessionDecode(network, frame, len, &view);
+  if (status == expected && (status != LORAWAN_OK || view.FCnt == count))
+    return;
+  Failures++;
+  printf("FAIL FCnt 0x%X: %s, expected %s\n", count, Status[status], Status[expected]);
+}
+
+static void reset(LoRaWanSession *network)
+{
+  SessionSetKeys(network, DevAddr, NwkSKey, AppSKey);
+}
+
+// ----------------------------------------------------------------------------
+// The lower 16 bits wrap: late frames from before the wrap are still found,
+// once.
+// ----------------------------------------------------------------------------
+static void testRollover()
+{
+  LoRaWanSession network;
+  reset(&network);
+  network.FCntUp = 0xFFF0;
+
+  uplink(&network, 0xFFFE, LORAWAN_OK);
+  uplink(&network, 0x10005, LORAWAN_OK);
+  uplink(&network, 0xFFFF, LORAWAN_OK);
+  uplink(&network, 0xFFFF, LORAWAN_REPLAY);
+  uplink(&network, 0xFFFE, LORAWAN_REPLAY);
+  uplink(&network, 0x10006, LORAWAN_OK);
+}
+
+// ----------------------------------------------------------------------------
+// Late frames inside LORAWAN_REPLAY_WINDOW are accepted once, older ones are
+// replays; a jump of the counter moves the window along.
+// ----------------------------------------------------------------------------
+static void testWindow()
+{
+  LoRaWanSession network;
+  reset(&network);
+
+  // in the window, once
+  uplink(&network, 10, LORAWAN_OK);
+  uplink(&network, 20, LORAWAN_OK);
+  uplink(&network, 15, LORAWAN_OK);
+  uplink(&network, 15, LORAWAN_REPLAY);
+  uplink(&network, 20, LORAWAN_REPLAY);
+  uplink(&network, 10, LORAWAN_REPLAY);
+  uplink(&network, 11, LORAWAN_OK);
+
+  // the oldest counter the window holds, and the one before it
+  uplink(&network, 100, LORAWAN_OK);
+  uplink(&network, 100 - LORAWAN_REPLAY_WINDOW, LORAWAN_REPLAY);
+  uplink(&network, 100 - LORAWAN_REPLAY_WINDOW + 1, LORAWAN_OK);
+  uplink(&network, 100 - LORAWAN_REPLAY_WINDOW + 1, LORAWAN_REPLAY);
+  uplink(&network, 60, LORAWAN_REPLAY);
+
+  // a shift of 31 keeps the bit of 200 at the end of the window
+  uplink(&network, 200, LORAWAN_OK);
+  uplink(&network, 231, LORAWAN_OK);
+  uplink(&network, 200, LORAWAN_REPLAY);
+  uplink(&network, 201, LORAWAN_OK);
+
+  // a shift of more than 32 clears the window
+  uplink(&network, 300, LORAWAN_OK);
+  uplink(&network, 340, LORAWAN_OK);
+  uplink(&network, 300, LORAWAN_REPLAY);
+  uplink(&network, 339, LORAWAN_OK);
+  uplink(&network, 339, LORAWAN_REPLAY);
+  uplink(&network, 310, LORAWAN_OK);
+  uplink(&network, 340, LORAWAN_REPLAY);
+  uplink(&network, 341, LORAWAN_OK);
+}
+
+// ----------------------------------------------------------------------------
+// A window that straddles 0x10000 and 0x20000, filled out of order
+// ----------------------------------------------------------------------------
+static void testStraddle()
+{
+  LoRaWanSession network;
+
+  for (uint32_t wrap = 0x10000; wrap <= 0x20000; wrap += 0x10000)
+  {
+    reset(&network);
+    network.FCntUp = wrap - 0x100;
+
+    uplink(&network, wrap - 10, LORAWAN_OK);
+    uplink(&network, wrap + 10, LORAWAN_OK);
+    for (uint32_t c = wrap - 9; c < wrap + 10; c += 2)
+      uplink(&network, c, LORAWAN_OK);
+    for (uint32_t c = wrap - 10; c <= wrap + 10; c++)
+      uplink(&network, c, (c & 1) || c == wrap - 10 || c == wrap + 10 ? LORAWAN_REPLAY : LORAWAN_OK);
+    for (uint32_t c = wrap - 10; c <= wrap + 10; c++)
+      uplink(&network, c, LORAWAN_REPLAY);
+    uplink(&network, wrap + 11, LORAWAN_OK);
+  }
+}
+
+// ----------------------------------------------------------------------------
+// Home entry of a DevAddr, the hash of LoRaWanSessionTable for an index of
+// 16 entries
+// ----------------------------------------------------------------------------
+#define TABLE_CAPACITY 8
+#define TABLE_MASK 15
+
+static uint32_t home(uint32_t devAddr)
+{
+  devAddr *= 0x9E3779B1;
+  return (devAddr ^ (devAddr >> 16)) & TABLE_MASK;
+}
+
+// ----------------------------------------------------------------------------
+// A chain of DevAddrs sharing the last home entry wraps around the index, and
+// ones homed at the entries it runs over sit behind it. Each one is removed
+// in turn from a full table: every other DevAddr is still found with its own
+// session, the removed one is not, and it can be added back.
+// ----------------------------------------------------------------------------
+static void testTable()
+{
+  uint32_t devAddrs[TABLE_CAPACITY];
+  uint8_t n = 0;
+
+  for (uint32_t d = 0x26000000; n < 5; d++)
+    if (home(d) == TABLE_MASK)
+      devAddrs[n++] = d;
+  for (uint32_t d = 0x26000000; n < TABLE_CAPACITY; d++)
+    if (home(d) == (uint32_t)(n - 5) * 2)
+      devAddrs[n++] = d;
+
+  for (uint8_t r = 0; r < TABLE_CAPACITY; r++)
+  {
+    LoRaWanSessionTable table(TABLE_CAPACITY);
+    for (uint8_t i = 0; i < TABLE_CAPACITY; i++)
+      table.add(devAddrs[i], NwkSKey, AppSKey);
+
+    if (!table.remove(devAddrs[r]) || table.remove(devAddrs[r]) || table.size() != TABLE_CAPACITY - 1)
+    {
+      Failures++;
+      printf("FAIL remove of entry %d\n", r);
+    }
+    for (uint8_t i = 0; i < TABLE_CAPACITY; i++)
+    {
+      LoRaWanSession *s = table.find(devAddrs[i]);
+      if ((i == r) ? s != NULL : (s == NULL || SessionDevAddr(s) != devAddrs[i]))
+      {
+        Failures++;
+        printf("FAIL find of entry %d after removing %d\n", i, r);
+      }
+    }
+    if (table.add(devAddrs[r], NwkSKey, AppSKey) == NULL || table.find(devAddrs[r]) == NULL || table.size() != TABLE_CAPACITY)
+    {
+      Failures++;
+      printf("FAIL add of entry %d back\n", r);
+    }
+  }
+}
+
+int main()
+{
+  testRollover();
+  printf("%-16s %s\n", "rollover", Failures ? "FAIL" : "ok");
+  testWindow();
+  testStraddle();
+  printf("%-16s %s\n", "replay window", Failures ? "FAIL" : "ok");
+  testTable();
+  printf("%-16s %s\n", "session table", Failures ? "FAIL" : "ok");
+
+  return Failures ? 1 : 0;
+}
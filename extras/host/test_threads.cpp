@@ -0,0 +1,205 @@
+// ----------------------------------------------- //
+// test_threads.cpp
+// ----------------------------------------------- //
+//
+// Concurrency stress test of the reentrant AES core
+// and of the decode paths built on it. Threads
+// encrypt, encode and decode at the same time and
+// every result must match a single thread run.
+//
+// ----------------------------------------------- //
+
+#include <Arduino.h>
+#include <thread>
+#include <atomic>
+#include "LoRaWanPacket.h"
+#include "LoRaWanSessionTable.h"
+
+#define STRESS_THREADS 8
+#define STRESS_KEYS 16
+#define STRESS_BLOCKS 64
+#define STRESS_ROUNDS 200
+#define STRESS_DEVICES 64
+#define STRESS_FRAMES 4096
+
+static uint8_t Keys[STRESS_KEYS][16];
+static AES_Context Contexts[STRESS_KEYS];
+static uint8_t Plain[STRESS_BLOCKS][16];
+static uint8_t Cipher[STRESS_KEYS][STRESS_BLOCKS][16];
+
+static std::atomic<uint32_t> Failures(0);
+
+static void fail(const char *what, int thread)
+{
+  if (Failures++ < 10)
+    printf("FAIL %s, thread %d\n", what, thread);
+}
+
+// ----------------------------------------------------------------------------
+// Every thread walks the keys in its own order, so the threads encrypt with
+// different keys at the same moment, through each entry point of the core.
+// ----------------------------------------------------------------------------
+static void stressAes(int thread)
+{
+  uint8_t block[16];
+  uint8_t blocks[16 * STRESS_BLOCKS];
+
+  for (int round = 0; round < STRESS_ROUNDS; round++)
+  {
+    int k = (round * 7 + thread * 3) % STRESS_KEYS;
+    int b = (round + thread) % STRESS_BLOCKS;
+
+    memcpy(block, Plain[b], 16);
+    AES_Encrypt(block, Keys[k]);
+    if (memcmp(block, Cipher[k][b], 16))
+      fail("AES_Encrypt (key)", thread);
+
+    memcpy(block, Plain[b], 16);
+    AES_Encrypt(block, &Contexts[k]);
+    if (memcmp(block, Cipher[k][b], 16))
+      fail("AES_Encrypt (context)", thread);
+
+    // 1...STRESS_BLOCKS blocks, short passes and full ones
+    int n = 1 + (round * 13 + thread) % STRESS_BLOCKS;
+    memcpy(blocks, Plain, 16 * n);
+    AES_Encrypt_Blocks(blocks, n, &Contexts[k]);
+    if (memcmp(blocks, Cipher[k], 16 * n))
+      fail("AES_Encrypt_Blocks", thread);
+  }
+}
+
+// ----------------------------------------------------------------------------
+// One packet per thread, every uplink is decoded back by a session that
+// shares its keys.
+// ----------------------------------------------------------------------------
+static void stressPacket(int thread)
+{
+  LoRaWanPacketSized<LORAWAN_HEADROOM + 255> packet;
+  LoRaWanSession network;
+  LoRaWanView view;
+  uint8_t devAddr[4] = {0x26, 0x01, 0x00, (uint8_t)thread};
+  uint8_t frame[256];
+
+  packet.debug = 0;
+  packet.setPort(1 + thread);
+  SessionSetKeys(&packet.Session, devAddr, Keys[thread % STRESS_KEYS], Keys[(thread + 1) % STRESS_KEYS]);
+  network = packet.Session;
+
+  for (int round = 0; round < STRESS_ROUNDS; round++)
+  {
+    int size = (round * 31 + thread) % 243;
+    packet.clear();
+    for (int i = 0; i < size; i++)
+      packet.write((uint8_t)(i ^ thread));
+    if (packet.encode() != 1)
+    {
+      fail("encode()", thread);
+      continue;
+    }
+
+    uint8_t len = packet.length();
+    memcpy(frame, packet.buffer(), len);
+    if (SessionDecode(&network, frame, len, &view) != LORAWAN_OK || view.PayloadLen != size)
+    {
+      fail("SessionDecode()", thread);
+      continue;
+    }
+    for (int i = 0; i < size; i++)
+    {
+      if (frame[view.Payload + i] != (uint8_t)(i ^ thread))
+      {
+        fail("payload", thread);
+        break;
+      }
+    }
+  }
+}
+
+// ----------------------------------------------------------------------------
+// decodeBatch() over several threads against the same frames decoded one by
+// one in a second table.
+// ----------------------------------------------------------------------------
+static void stressBatch()
+{
+  static uint8_t frames[STRESS_FRAMES][64];
+  static uint8_t copies[STRESS_FRAMES][64];
+  static LoRaWanFrame batch[STRESS_FRAMES];
+  LoRaWanSessionTable table(STRESS_DEVICES), serial(STRESS_DEVICES);
+  LoRaWanSession uplink[STRESS_DEVICES];
+
+  for (int d = 0; d < STRESS_DEVICES; d++)
+  {
+    uint32_t devAddr = 0x26010000 + d;
+    uplink[d] = *table.add(devAddr, Keys[d % STRESS_KEYS], Keys[(d + 5) % STRESS_KEYS]);
+    serial.add(devAddr, Keys[d % STRESS_KEYS], Keys[(d + 5) % STRESS_KEYS]);
+  }
+
+  srand(1);
+  for (int f = 0; f < STRESS_FRAMES; f++)
+  {
+    int d = rand() % STRESS_DEVICES;
+    // a few frames are replays or corrupted
+    if (f % 97 == 0 && uplink[d].FCntUp > 0)
+      uplink[d].FCntUp--;
+    uint8_t len = LoRaWanUplink<0, false, 32>::encode(&uplink[d], frames[f], 0, NULL, 1, Plain[f % STRESS_BLOCKS]);
+    if (f % 89 == 0)
+      frames[f][10] ^= 0x01;
+    memcpy(copies[f], frames[f], len);
+    batch[f].buf = frames[f];
+    batch[f].len = len;
+  }
+
+  table.decodeBatch(batch, STRESS_FRAMES, STRESS_THREADS);
+
+  for (int f = 0; f < STRESS_FRAMES; f++)
+  {
+    LoRaWanView view;
+    LoRaWanStatus status = serial.decode(copies[f], batch[f].len, &view);
+    if (status != batch[f].view.Status || memcmp(copies[f], frames[f], batch[f].len))
+    {
+      fail("decodeBatch()", f);
+      break;
+    }
+  }
+}
+
+template <typename Op>
+static void run(const char *name, Op op)
+{
+  std::thread pool[STRESS_THREADS];
+  for (int t = 0; t < STRESS_THREADS; t++)
+    pool[t] = std::thread(op, t);
+  for (int t = 0; t < STRESS_THREADS; t++)
+    pool[t].join();
+  printf("%-16s %s\n", name, Failures ? "FAIL" : "ok");
+}
+
+int main()
+{
+  for (int k = 0; k < STRESS_KEYS; k++)
+  {
+    for (int i = 0; i < 16; i++)
+      Keys[k][i] = (uint8_t)(k * 37 + i * 11);
+    AES_Expand_Key(&Contexts[k], Keys[k]);
+  }
+  for (int b = 0; b < STRESS_BLOCKS; b++)
+    for (int i = 0; i < 16; i++)
+      Plain[b][i] = (uint8_t)(b * 5 + i * 3);
+
+  // reference, one thread
+  for (int k = 0; k < STRESS_KEYS; k++)
+  {
+    for (int b = 0; b < STRESS_BLOCKS; b++)
+    {
+      memcpy(Cipher[k][b], Plain[b], 16);
+      AES_Encrypt(Cipher[k][b], Keys[k]);
+    }
+  }
+
+  run("aes", stressAes);
+  run("encode/decode", stressPacket);
+  stressBatch();
+  printf("%-16s %s\n", "decodeBatch", Failures ? "FAIL" : "ok");
+
+  return Failures ? 1 : 0;
+}
@@ -0,0 +1,79 @@
+// ----------------------------------------------- //
+// LoRaWanEncoder.h
+// ----------------------------------------------- //
+//
+// Uplink encoders specialized at compile time on
+// the FOpts length, the port and the payload size
+//
+// ----------------------------------------------- //
+
+#ifndef LORAWAN_ENCODER_H
+#define LORAWAN_ENCODER_H
+
+#include <Arduino.h>
+#include "LoRaWanSession.h"
+
+// ----------------------------------------------------------------------------
+// LoRaWanUplink
+// Parameters:
+//  - FOPTS: Bytes of MAC commands piggybacked in FOpts, 0...15
+//  - MAC_PORT: true for FPort 0, the payload then holds MAC commands and is
+//    encrypted with the NwkSKey
+//  - SIZE: Bytes of FRMPayload, 0 sends no FPort
+//
+// Every offset and the frame length are constants, so encode() compiles to
+// a fixed sequence of stores and one crypto call:
+//  MHDR(0) | DevAddr(1) | FCtrl(5) | FCnt(6) | FOpts(8) | FPort | FRMPayload | MIC
+// ----------------------------------------------------------------------------
+template <uint8_t FOPTS, bool MAC_PORT, uint8_t SIZE>
+struct LoRaWanUplink
+{
+	static_assert(FOPTS <= 15, "FOpts holds at most 15 bytes");
+	static_assert(!(MAC_PORT && FOPTS), "MAC commands go either in FOpts or on port 0");
+
+	static const uint8_t FOpts = 8;
+	static const uint8_t FPort = 8 + FOPTS;
+	static const uint8_t Payload = 9 + FOPTS;
+	static const uint8_t Length = 8 + FOPTS + (SIZE ? 1 + SIZE : 0) + 4;
+
+	// ----------------------------------------------------------------------------
+	// encode
+	// Parameters:
+	//  - session: Sending session, FCntUp moves to the next frame
+	//  - frame: Output, Length bytes
+	//  - fctrl: FCtrl flags, FOptsLen is added here
+	//  - fopts: FOPTS bytes of MAC commands
+	//  - fport: Port of the payload, ignored for MAC_PORT
+	//  - payload: SIZE bytes, NULL when they are already at frame + Payload
+	//
+	// Returns Length.
+	// ----------------------------------------------------------------------------
+	static uint8_t encode(LoRaWanSession *session, uint8_t *frame, uint8_t fctrl, const uint8_t *fopts, uint8_t fport, const uint8_t *payload)
+	{
+		uint32_t count = session->FCntUp;
+
+		frame[0] = 0x40; // unconfirmed up
+		frame[1] = session->DevAddr[3];
+		frame[2] = session->DevAddr[2];
+		frame[3] = session->DevAddr[1];
+		frame[4] = session->DevAddr[0];
+		frame[5] = (fctrl & 0xF0) | FOPTS;
+		frame[6] = count & 0xFF;
+		frame[7] = (count >> 8) & 0xFF;
+
+		if (FOPTS)
+			memcpy(frame + FOpts, fopts, FOPTS);
+
+		if (SIZE)
+			frame[FPort] = MAC_PORT ? 0 : fport;
+
+		// encrypted straight from payload, MIC in the same pass
+		Payload_Fragment data = {payload ? payload : frame + Payload, SIZE};
+		PayloadEncodeMic(frame, SIZE ? Payload : FPort, &data, 1, MAC_PORT ? &session->NwkSKey.Context : &session->AppSKey, &session->NwkSKey, session->DevAddr, count, 0);
+
+		session->FCntUp = count + 1;
+		return Length;
+	}
+};
+
+#endif
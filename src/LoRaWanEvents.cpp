@@ -0,0 +1,68 @@
+// ----------------------------------------------- //
+// LoRaWanEvents.cpp
+// ----------------------------------------------- //
+//
+// Ring of decode events, written by the library
+// and read by the application when it has time
+//
+// ----------------------------------------------- //
+
+#include "LoRaWanEvents.h"
+
+#if LORAWAN_EVENTS > 0
+
+// Acquire and release on the indexes, so the event is written before Head
+// shows it and read before Tail gives the slot back
+#if defined(__GNUC__)
+#define EVENTS_LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define EVENTS_STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#else
+#define EVENTS_LOAD(x) (*(volatile uint8_t *)&(x))
+#define EVENTS_STORE(x, v) (*(volatile uint8_t *)&(x) = (v))
+#endif
+
+void EventsClear(LoRaWanEvents *events)
+{
+  memset(events, 0, sizeof(LoRaWanEvents));
+}
+
+// ----------------------------------------------------------------------------
+// EventsPush
+// Called by the library only, never blocks.
+// Returns false when the ring is full and the event was dropped.
+// ----------------------------------------------------------------------------
+bool EventsPush(LoRaWanEvents *events, uint8_t type, uint8_t value, uint16_t fcnt)
+{
+  uint8_t head = events->Head;
+  if ((uint8_t)(head - EVENTS_LOAD(events->Tail)) >= LORAWAN_EVENTS)
+  {
+    if (events->Dropped < 255)
+      events->Dropped++;
+    return false;
+  }
+
+  LoRaWanEvent *event = &events->Event[head & (LORAWAN_EVENTS - 1)];
+  event->Type = type;
+  event->Value = value;
+  event->FCnt = fcnt;
+  EVENTS_STORE(events->Head, (uint8_t)(head + 1));
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+// EventsPop
+// Copies the oldest event to event.
+// Returns false when the ring is empty.
+// ----------------------------------------------------------------------------
+bool EventsPop(LoRaWanEvents *events, LoRaWanEvent *event)
+{
+  uint8_t tail = events->Tail;
+  if (tail == EVENTS_LOAD(events->Head))
+    return false;
+
+  *event = events->Event[tail & (LORAWAN_EVENTS - 1)];
+  EVENTS_STORE(events->Tail, (uint8_t)(tail + 1));
+  return true;
+}
+
+#endif
@@ -0,0 +1,55 @@
+// ----------------------------------------------- //
+// LoRaWanEvents.h
+// ----------------------------------------------- //
+//
+// Ring of decode events, written by the library
+// and read by the application when it has time
+//
+// ----------------------------------------------- //
+
+#ifndef LORAWAN_EVENTS_H
+#define LORAWAN_EVENTS_H
+
+#include <Arduino.h>
+
+// Events kept until the application reads them, a power of two up to 128,
+// 0 removes the ring. It sizes LoRaWanPacketBase, set it for the whole build.
+#ifndef LORAWAN_EVENTS
+#define LORAWAN_EVENTS 8
+#endif
+
+#if LORAWAN_EVENTS > 0
+
+static_assert((LORAWAN_EVENTS & (LORAWAN_EVENTS - 1)) == 0 && LORAWAN_EVENTS <= 128, "LORAWAN_EVENTS must be a power of two up to 128");
+
+typedef enum {
+    LORAWAN_EVENT_MAC = 1,      // MAC command received, Value is its CID
+    LORAWAN_EVENT_MIC_ERROR,    // frame or join accept dropped on its MIC
+    LORAWAN_EVENT_REPLAY,       // frame dropped, counter already seen
+} LoRaWanEventType;
+
+typedef struct {
+    uint8_t Type;               // LoRaWanEventType
+    uint8_t Value;
+    uint16_t FCnt;              // FCnt field of the frame
+} LoRaWanEvent;
+
+// ----------------------------------------------------------------------------
+// One writer and one reader, decode() may run in the radio interrupt while
+// loop() reads. Head and Tail count events and wrap at 256, only the writer
+// moves Head and only the reader moves Tail. A full ring drops the new event.
+// ----------------------------------------------------------------------------
+typedef struct {
+    LoRaWanEvent Event[LORAWAN_EVENTS];
+    uint8_t Head;
+    uint8_t Tail;
+    uint8_t Dropped;            // events lost to a full ring, saturates at 255
+} LoRaWanEvents;
+
+void EventsClear(LoRaWanEvents *events);
+bool EventsPush(LoRaWanEvents *events, uint8_t type, uint8_t value, uint16_t fcnt);
+bool EventsPop(LoRaWanEvents *events, LoRaWanEvent *event);
+
+#endif
+
+#endif
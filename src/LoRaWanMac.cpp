@@ -0,0 +1,271 @@
+// ----------------------------------------------- //
+// LoRaWanMac.cpp
+// ----------------------------------------------- //
+//
+// MAC commands sent by the network, read from
+// FOpts or a port 0 payload in a single pass
+//
+// ----------------------------------------------- //
+
+#include "LoRaWanMac.h"
+
+static uint32_t MacFrequency(const uint8_t *buf)
+{
+  return ((uint32_t)buf[0] | ((uint32_t)buf[1] << 8) | ((uint32_t)buf[2] << 16)) * 100;
+}
+
+static void MacLinkCheckAns(LoRaWanMac *mac, const uint8_t *buf)
+{
+  mac->Margin = buf[0];
+  mac->GwCnt = buf[1];
+}
+
+static void MacLinkADRReq(LoRaWanMac *mac, const uint8_t *buf)
+{
+  mac->DataRate = buf[0] >> 4;
+  mac->TxPower = buf[0] & 0x0F;
+  mac->ChMask = buf[1] | (buf[2] << 8);
+  mac->ChMaskCntl = (buf[3] >> 4) & 0x07;
+  mac->NbTrans = buf[3] & 0x0F;
+}
+
+static void MacDutyCycleReq(LoRaWanMac *mac, const uint8_t *buf)
+{
+  mac->MaxDutyCycle = buf[0] & 0x0F;
+}
+
+static void MacRXParamSetupReq(LoRaWanMac *mac, const uint8_t *buf)
+{
+  mac->RX1DROffset = (buf[0] >> 4) & 0x07;
+  mac->RX2DataRate = buf[0] & 0x0F;
+  mac->RX2Frequency = MacFrequency(buf + 1);
+}
+
+static void MacNewChannelReq(LoRaWanMac *mac, const uint8_t *buf)
+{
+  mac->ChIndex = buf[0];
+  mac->ChFrequency = MacFrequency(buf + 1);
+  mac->ChMinDR = buf[4] & 0x0F;
+  mac->ChMaxDR = buf[4] >> 4;
+}
+
+static void MacRXTimingSetupReq(LoRaWanMac *mac, const uint8_t *buf)
+{
+  // 0 also means 1 second
+  mac->RXDelay = (buf[0] & 0x0F) ? (buf[0] & 0x0F) : 1;
+}
+
+typedef void (*MacHandler)(LoRaWanMac *mac, const uint8_t *buf);
+
+// Every CID from 0x02, with the length after the CID of the request and of
+// its answer. Status has the ACK bits an answer can carry, the application
+// sets them with MacAnswer() once it applied the settings. A Single answer
+// replaces the one still queued for an older request, the others are sent
+// once per request.
+static const struct {
+  uint8_t Length;
+  uint8_t AnswerLength;
+  uint8_t Status;
+  bool Single;
+  MacHandler Handler;
+} MacCommands[] = {
+  {2, 0, 0x00, true,  MacLinkCheckAns},         // 0x02, LinkCheckReq has no answer
+  {4, 1, 0x07, false, MacLinkADRReq},           // 0x03
+  {1, 0, 0x00, true,  MacDutyCycleReq},         // 0x04
+  {4, 1, 0x07, true,  MacRXParamSetupReq},      // 0x05
+  {0, 2, 0x00, true,  NULL},                    // 0x06 DevStatusReq
+  {5, 1, 0x03, false, MacNewChannelReq},        // 0x07
+  {1, 0, 0x00, true,  MacRXTimingSetupReq},     // 0x08
+  {1, 0, 0x00, true,  NULL},                    // 0x09 TxParamSetupReq
+  {4, 1, 0x03, false, NULL},                    // 0x0A DlChannelReq
+};
+
+#define MCMD_FIRST MCMD_LINK_CHECK_ANS
+#define MCMD_COUNT (sizeof(MacCommands) / sizeof(MacCommands[0]))
+
+// High bit of a queued CID, its answer waits for MacAnswer()
+#define MAC_PENDING 0x80
+#define MAC_CID(q) ((q) & ~MAC_PENDING)
+
+static bool MacQueuePush(LoRaWanMac *mac, uint8_t cid, const uint8_t *data, uint8_t len, uint8_t pending);
+static uint8_t MacRelease(LoRaWanMac *mac, uint8_t cid, uint8_t status);
+
+void MacClear(LoRaWanMac *mac)
+{
+  memset(mac, 0, sizeof(LoRaWanMac));
+  mac->Battery = 255;
+}
+
+// ----------------------------------------------------------------------------
+// MacCommand
+// Parameters:
+//  - mac: Settings updated by the command
+//  - buf: CID of the command, followed by its fields
+//  - len: Bytes left in FOpts or the port 0 payload
+//
+// Returns the length of the command with its CID, or 0 for an unknown CID
+// or a truncated command; the length of what follows is then unknown and
+// the rest of the frame has to be skipped.
+// ----------------------------------------------------------------------------
+uint8_t MacCommand(LoRaWanMac *mac, const uint8_t *buf, uint8_t len)
+{
+  if (len == 0)
+    return 0;
+
+  uint8_t cid = buf[0];
+  if (cid < MCMD_FIRST || cid >= MCMD_FIRST + MCMD_COUNT)
+    return 0;
+
+  uint8_t length = MacCommands[cid - MCMD_FIRST].Length + 1;
+  if (length > len)
+    return 0;
+
+  if (MacCommands[cid - MCMD_FIRST].Handler)
+    MacCommands[cid - MCMD_FIRST].Handler(mac, buf + 1);
+  mac->Received |= MCMD_BIT(cid);
+
+  // answer, LinkCheckAns is itself the answer of the device's LinkCheckReq;
+  // the answer of a setting waits for the application, it holds no ACK bit
+  // until then
+  if (cid == MCMD_DEV_STATUS_REQ)
+  {
+    int8_t snr = (mac->Snr < -32) ? -32 : (mac->Snr > 31) ? 31 : mac->Snr;
+    uint8_t status[2] = {mac->Battery, (uint8_t)(snr & 0x3F)};
+    MacQueue(mac, MCMD_DEV_STATUS_ANS, status, 2);
+  }
+  else if (cid != MCMD_LINK_CHECK_ANS)
+  {
+    uint8_t status = 0x00;
+    MacQueuePush(mac, cid, &status, MacCommands[cid - MCMD_FIRST].AnswerLength, MAC_PENDING);
+  }
+  return length;
+}
+
+// ----------------------------------------------------------------------------
+// MacAnswer
+// Parameters:
+//  - cid: Request the application has seen in Received
+//  - status: ACK bits of the settings it applied, 0x00 refuses them all;
+//    ignored by the answers without a field
+//
+// Releases the answers of cid still waiting, the next uplinks send them.
+// Returns the number of answers released.
+// ----------------------------------------------------------------------------
+uint8_t MacAnswer(LoRaWanMac *mac, uint8_t cid, uint8_t status)
+{
+  if (cid < MCMD_FIRST || cid >= MCMD_FIRST + MCMD_COUNT)
+    return 0;
+  return MacRelease(mac, cid, status);
+}
+
+// ----------------------------------------------------------------------------
+// MacAccept
+// Releases every answer still waiting with all its ACK bits, encode() does it
+// unless Hold is set.
+// ----------------------------------------------------------------------------
+uint8_t MacAccept(LoRaWanMac *mac)
+{
+  return MacRelease(mac, 0, 0xFF);
+}
+
+// cid 0 releases the answers of every command
+static uint8_t MacRelease(LoRaWanMac *mac, uint8_t cid, uint8_t status)
+{
+  uint8_t n = 0;
+  for (uint8_t i = 0; i < mac->QueueLen; i += 1 + MacCommands[MAC_CID(mac->Queue[i]) - MCMD_FIRST].AnswerLength)
+  {
+    uint8_t q = MAC_CID(mac->Queue[i]);
+    if (!(mac->Queue[i] & MAC_PENDING) || (cid && q != cid))
+      continue;
+    mac->Queue[i] = q;
+    if (MacCommands[q - MCMD_FIRST].AnswerLength)
+      mac->Queue[i + 1] = status & MacCommands[q - MCMD_FIRST].Status;
+    n++;
+  }
+  return n;
+}
+
+// ----------------------------------------------------------------------------
+// MacQueue
+// Parameters:
+//  - cid: Uplink MAC command, an answer or LinkCheckReq
+//  - data: Its fields, len bytes as the command expects
+//
+// Returns false when the queue is full or cid and len do not match, the
+// command is then dropped.
+// ----------------------------------------------------------------------------
+bool MacQueue(LoRaWanMac *mac, uint8_t cid, const uint8_t *data, uint8_t len)
+{
+  return MacQueuePush(mac, cid, data, len, 0);
+}
+
+static bool MacQueuePush(LoRaWanMac *mac, uint8_t cid, const uint8_t *data, uint8_t len, uint8_t pending)
+{
+  if (cid < MCMD_FIRST || cid >= MCMD_FIRST + MCMD_COUNT || len != MacCommands[cid - MCMD_FIRST].AnswerLength)
+    return false;
+
+  uint8_t i = 0;
+  while (MacCommands[cid - MCMD_FIRST].Single && i < mac->QueueLen)
+  {
+    if (MAC_CID(mac->Queue[i]) == cid)
+    {
+      mac->Queue[i] = cid | pending;
+      memcpy(mac->Queue + i + 1, data, len);
+      return true;
+    }
+    i += 1 + MacCommands[MAC_CID(mac->Queue[i]) - MCMD_FIRST].AnswerLength;
+  }
+
+  if (mac->QueueLen + 1 + len > LORAWAN_MAC_QUEUE)
+    return false;
+
+  mac->Queue[mac->QueueLen] = cid | pending;
+  memcpy(mac->Queue + mac->QueueLen + 1, data, len);
+  mac->QueueLen += 1 + len;
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+// MacQueueFit
+// Returns the bytes of the whole commands, from the oldest, that fit in room.
+// The answers still waiting for MacAnswer() move behind the ready ones, which
+// keep their order and go first.
+// ----------------------------------------------------------------------------
+uint8_t MacQueueFit(LoRaWanMac *mac, uint8_t room)
+{
+  uint8_t sorted[LORAWAN_MAC_QUEUE];
+  uint8_t n = 0;
+  for (uint8_t pass = 0; pass < 2; pass++)
+  {
+    uint8_t length;
+    for (uint8_t i = 0; i < mac->QueueLen; i += length)
+    {
+      length = 1 + MacCommands[MAC_CID(mac->Queue[i]) - MCMD_FIRST].AnswerLength;
+      if ((mac->Queue[i] & MAC_PENDING) != (pass ? MAC_PENDING : 0))
+        continue;
+      memcpy(sorted + n, mac->Queue + i, length);
+      n += length;
+    }
+  }
+  memcpy(mac->Queue, sorted, n);
+
+  uint8_t i = 0;
+  while (i < mac->QueueLen && !(mac->Queue[i] & MAC_PENDING))
+  {
+    uint8_t next = i + 1 + MacCommands[mac->Queue[i] - MCMD_FIRST].AnswerLength;
+    if (next > room)
+      break;
+    i = next;
+  }
+  return i;
+}
+
+// ----------------------------------------------------------------------------
+// MacQueueDrop
+// Removes the len oldest bytes, once they are in an uplink.
+// ----------------------------------------------------------------------------
+void MacQueueDrop(LoRaWanMac *mac, uint8_t len)
+{
+  mac->QueueLen -= len;
+  memmove(mac->Queue, mac->Queue + len, mac->QueueLen);
+}
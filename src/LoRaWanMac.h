@@ -0,0 +1,109 @@
+// ----------------------------------------------- //
+// LoRaWanMac.h
+// ----------------------------------------------- //
+//
+// MAC commands sent by the network, read from
+// FOpts or a port 0 payload in a single pass
+//
+// ----------------------------------------------- //
+
+#ifndef LORAWAN_MAC_H
+#define LORAWAN_MAC_H
+
+#include <Arduino.h>
+
+enum {
+    // Downlink MAC commands (CID), LoRaWAN 1.0.x
+    MCMD_LINK_CHECK_ANS     = 0x02,   // u1:margin dB, u1:gateways
+    MCMD_LINK_ADR_REQ       = 0x03,   // u1:7-4 DR 3-0 TXPower, u2:ChMask, u1:6-4 ChMaskCntl 3-0 NbTrans
+    MCMD_DUTY_CYCLE_REQ     = 0x04,   // u1:3-0 MaxDCycle
+    MCMD_RX_PARAM_SETUP_REQ = 0x05,   // u1:6-4 RX1DROffset 3-0 RX2DataRate, u3:frequency/100
+    MCMD_DEV_STATUS_REQ     = 0x06,   // -
+    MCMD_NEW_CHANNEL_REQ    = 0x07,   // u1:ChIndex, u3:frequency/100, u1:7-4 MaxDR 3-0 MinDR
+    MCMD_RX_TIMING_SETUP_REQ= 0x08,   // u1:3-0 Del
+    MCMD_TX_PARAM_SETUP_REQ = 0x09,   // u1:EIRP and dwell time, 1.0.2
+    MCMD_DL_CHANNEL_REQ     = 0x0A,   // u1:ChIndex, u3:frequency/100, 1.0.2
+
+    // Uplink MAC commands, the answers share the CID of their request
+    MCMD_LINK_CHECK_REQ     = 0x02,   // -
+    MCMD_LINK_ADR_ANS       = 0x03,   // u1:2 power 1 DR 0 ChMask ACK
+    MCMD_DUTY_CYCLE_ANS     = 0x04,   // -
+    MCMD_RX_PARAM_SETUP_ANS = 0x05,   // u1:2 RX1DROffset 1 RX2DataRate 0 channel ACK
+    MCMD_DEV_STATUS_ANS     = 0x06,   // u1:battery 0,1-254,255=?, u1:7-6:RFU,5-0:margin(-32..31)
+    MCMD_NEW_CHANNEL_ANS    = 0x07,   // u1:1 DR range 0 frequency ACK
+    MCMD_RX_TIMING_SETUP_ANS= 0x08,   // -
+    MCMD_TX_PARAM_SETUP_ANS = 0x09,   // -
+    MCMD_DL_CHANNEL_ANS     = 0x0A,   // u1:1 uplink frequency 0 frequency ACK
+};
+
+#define MCMD_BIT(cid) ((uint16_t)1 << (cid))
+
+// Bytes of uplink MAC commands waiting for the next uplinks, the answers of
+// one full FOpts fit in 15. A build flag, like the other LoRaWanPacket sizes.
+#ifndef LORAWAN_MAC_QUEUE
+#define LORAWAN_MAC_QUEUE 32
+#endif
+
+// FOpts holds at most 15 bytes
+#define MAC_FOPTS_MAX 15
+
+// ----------------------------------------------------------------------------
+// Last settings asked by the network. Received has the bit MCMD_BIT(cid) of
+// every command of the last frame, the application applies the new settings
+// to its radio when it sees the bit and confirms them with MacAnswer() before
+// the next encode(). The answers it did not confirm are sent then with every
+// ACK bit, or wait for MacAnswer() when Hold is set; the other answers go out
+// either way.
+// ----------------------------------------------------------------------------
+typedef struct {
+	uint16_t Received;
+	bool Hold;                  // answers wait for MacAnswer() across uplinks
+
+	// LinkADRReq, a block of several requests leaves the last ChMask here
+	uint8_t DataRate;
+	uint8_t TxPower;
+	uint16_t ChMask;
+	uint8_t ChMaskCntl;
+	uint8_t NbTrans;
+
+	// DutyCycleReq, aggregated duty cycle 1 / 2^MaxDutyCycle
+	uint8_t MaxDutyCycle;
+
+	// RXParamSetupReq
+	uint8_t RX1DROffset;
+	uint8_t RX2DataRate;
+	uint32_t RX2Frequency;      // Hz
+
+	// RXTimingSetupReq, seconds from the end of the uplink to RX1
+	uint8_t RXDelay;
+
+	// NewChannelReq, the last channel set
+	uint8_t ChIndex;
+	uint32_t ChFrequency;       // Hz, 0 disables the channel
+	uint8_t ChMinDR;
+	uint8_t ChMaxDR;
+
+	// LinkCheckAns
+	uint8_t Margin;             // dB above the demodulation floor
+	uint8_t GwCnt;
+
+	// DevStatusAns, set by the application before decode()
+	uint8_t Battery;            // 0 external power, 1-254 level, 255 unknown
+	int8_t Snr;                 // dB, of the last downlink
+
+	// Answers in the order of the requests, whole commands with their CID;
+	// the high bit of a CID marks an answer waiting for MacAnswer()
+	uint8_t Queue[LORAWAN_MAC_QUEUE];
+	uint8_t QueueLen;
+} LoRaWanMac;
+
+void MacClear(LoRaWanMac *mac);
+uint8_t MacCommand(LoRaWanMac *mac, const uint8_t *buf, uint8_t len);
+uint8_t MacAnswer(LoRaWanMac *mac, uint8_t cid, uint8_t status);
+uint8_t MacAccept(LoRaWanMac *mac);
+
+bool MacQueue(LoRaWanMac *mac, uint8_t cid, const uint8_t *data, uint8_t len);
+uint8_t MacQueueFit(LoRaWanMac *mac, uint8_t room);
+void MacQueueDrop(LoRaWanMac *mac, uint8_t len);
+
+#endif
@@ -13,57 +13,77 @@
 #include "crypto/LoRaUtilities.h"
 #include "LoRaWanPacket.h"
 
-LoRaWanPacketClass::LoRaWanPacketClass()
+// ----------------------------------------------------------------------------
+// LoRaWanPacketBase
+// Parameters:
+//  - buf: Frame buffer of the derived LoRaWanPacketSized
+//  - size: Its capacity in bytes
+// ----------------------------------------------------------------------------
+LoRaWanPacketBase::LoRaWanPacketBase(uint8_t *buf, uint16_t size)
 {
+  payload_buf = buf;
+  payload_size = size;
+  payload_len = LORAWAN_HEADROOM;
+  payload_position = LORAWAN_HEADROOM;
   setTimeout(0);
+  SessionClear(&Session);
+  memset(&Identity, 0, sizeof(LoRaWanIdentity));
+  MacClear(&Mac);
+  memset(&Stats, 0, sizeof(LoRaWanStats));
+#if LORAWAN_EVENTS > 0
+  EventsClear(&Events);
+#endif
 }
 
-int LoRaWanPacketClass::begin()
+int LoRaWanPacketBase::begin()
 {
   return 1;
 }
 
-void LoRaWanPacketClass::end()
+void LoRaWanPacketBase::end()
 {
 }
 
-size_t LoRaWanPacketClass::write(uint8_t c)
+size_t LoRaWanPacketBase::write(uint8_t c)
 {
+  if (payload_len >= payload_size && !front())
+    return 0;
   payload_buf[payload_len++] = c;
   return 1;
 };
 
-size_t LoRaWanPacketClass::write(const uint8_t *buffer, size_t size)
+size_t LoRaWanPacketBase::write(const uint8_t *buffer, size_t size)
 {
-  size_t n = 0;
-  for (size_t i = 0; i < size; i++)
-  {
-    n += write(*(buffer + i));
-  }
-  return n;
+  if (size > (size_t)(payload_size - payload_len))
+    front();
+  if (size > (size_t)(payload_size - payload_len))
+    size = payload_size - payload_len;
+  memcpy(payload_buf + payload_len, buffer, size);
+  payload_len += size;
+  return size;
 }
 
-int LoRaWanPacketClass::available()
+int LoRaWanPacketBase::available()
 {
   return payload_len - payload_position;
 }
 
-int LoRaWanPacketClass::read()
+int LoRaWanPacketBase::read()
 {
   return payload_position < payload_len ? payload_buf[payload_position++] : -1;
 }
 
-int LoRaWanPacketClass::peek()
+int LoRaWanPacketBase::peek()
 {
   return payload_position < payload_len ? payload_buf[payload_position] : -1;
 }
 
-void LoRaWanPacketClass::flush()
+void LoRaWanPacketBase::flush()
 {
 
 }
 
-unsigned int LoRaWanPacketClass::readInt()
+unsigned int LoRaWanPacketBase::readInt()
 {
   if (available() < 2) return 0;
   unsigned int i = 0;
@@ -72,7 +92,7 @@ unsigned int LoRaWanPacketClass::readInt()
   return i;
 }
 
-unsigned long LoRaWanPacketClass::readLong()
+unsigned long LoRaWanPacketBase::readLong()
 {
   if (available() < 4) return 0;
   unsigned long i = 0;
@@ -83,34 +103,77 @@ unsigned long LoRaWanPacketClass::readLong()
   return i;
 }
 
-uint8_t *LoRaWanPacketClass::buffer()
+uint8_t *LoRaWanPacketBase::buffer()
 {
-  return ((uint8_t *)&payload_buf) + payload_position;
+  return payload_buf + payload_position;
 }
 
-int LoRaWanPacketClass::length()
+int LoRaWanPacketBase::length()
 {
   return available();
 }
 
 
-void LoRaWanPacketClass::clear()
+// ----------------------------------------------------------------------------
+// clear
+// The next bytes written go after LORAWAN_HEADROOM, encode() then puts the
+// header in front of them without moving the payload. A longer frame written
+// to be decoded goes to the start of the buffer instead, see front().
+// ----------------------------------------------------------------------------
+void LoRaWanPacketBase::clear()
 {
-  payload_len = 0;
+  payload_len = LORAWAN_HEADROOM;
+  payload_position = LORAWAN_HEADROOM;
+}
+
+// ----------------------------------------------------------------------------
+// front
+// Moves the bytes written to the start of the buffer when they outgrow the
+// room behind the headroom, a received frame can then take the whole buffer.
+// encode() moves them back with headroom(). Returns false when there is no
+// room to gain.
+// ----------------------------------------------------------------------------
+bool LoRaWanPacketBase::front()
+{
+  if (payload_position == 0)
+    return false;
+
+  payload_len -= payload_position;
+  memmove(payload_buf, payload_buf + payload_position, payload_len);
   payload_position = 0;
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+// headroom
+// Moves bytes written without a clear(), after a join request, behind the
+// header headroom. Returns false when they do not fit there.
+// ----------------------------------------------------------------------------
+bool LoRaWanPacketBase::headroom()
+{
+  if (payload_position >= LORAWAN_HEADROOM)
+    return true;
+
+  uint16_t n = payload_len - payload_position;
+  if (LORAWAN_HEADROOM + n > payload_size)
+    return false;
+  memmove(payload_buf + LORAWAN_HEADROOM, payload_buf + payload_position, n);
+  payload_position = LORAWAN_HEADROOM;
+  payload_len = LORAWAN_HEADROOM + n;
+  return true;
 }
 
 // ----------------------------------------------- //
 // ----------------------------------------------- //
 // ----------------------------------------------- //
 
-void LoRaWanPacketClass::join(const char *_aeui, const char *_akey)
+void LoRaWanPacketBase::join(const char *_aeui, const char *_akey)
 {
   setAppKey(_akey);
   setAppEui(_aeui);
 }
 
-void LoRaWanPacketClass::join(const char *_deui, const char *_aeui, const char *_akey)
+void LoRaWanPacketBase::join(const char *_deui, const char *_aeui, const char *_akey)
 {
   setDevEui(_deui);
   setAppKey(_akey);
@@ -121,37 +184,39 @@ void LoRaWanPacketClass::join(const char *_deui, const char *_aeui, const char *
 // join keys
 // ---------------------------------------------------- //
 
-void LoRaWanPacketClass::setAppKey(uint8_t *_akey)
+void LoRaWanPacketBase::setAppKey(uint8_t *_akey)
 {
-  memcpy(AppKey, _akey, 16);
+  IdentitySetAppKey(&Identity, _akey);
 }
 
-void LoRaWanPacketClass::setAppKey(const char *_akey)
+void LoRaWanPacketBase::setAppKey(const char *_akey)
 {
-  LORA_HEX_TO_BYTE((char *) AppKey, (char *) _akey, 16);
+  uint8_t appKey[16];
+  LORA_HEX_TO_BYTE((char *)appKey, (char *) _akey, 16);
+  IdentitySetAppKey(&Identity, appKey);
 }
 
-void LoRaWanPacketClass::setAppEui(uint8_t *_aeui)
+void LoRaWanPacketBase::setAppEui(uint8_t *_aeui)
 {
-  memcpy(AppEui, _aeui, 8);
+  memcpy(Identity.AppEui, _aeui, 8);
 }
 
-void LoRaWanPacketClass::setAppEui(const char *_aeui)
+void LoRaWanPacketBase::setAppEui(const char *_aeui)
 {
-  LORA_HEX_TO_BYTE((char *) AppEui, (char *) _aeui, 8);
+  LORA_HEX_TO_BYTE((char *) Identity.AppEui, (char *) _aeui, 8);
 }
 
-void LoRaWanPacketClass::setDevEui(uint8_t *_deui)
+void LoRaWanPacketBase::setDevEui(uint8_t *_deui)
 {
-  memcpy(DevEui, _deui, 8);
+  memcpy(Identity.DevEui, _deui, 8);
 }
 
-void LoRaWanPacketClass::setDevEui(const char *_deui)
+void LoRaWanPacketBase::setDevEui(const char *_deui)
 {
-  LORA_HEX_TO_BYTE((char *) DevEui, (char *) _deui, 8);
+  LORA_HEX_TO_BYTE((char *) Identity.DevEui, (char *) _deui, 8);
 }
 
-void LoRaWanPacketClass::personalize(const char *_devAddr, const char *_nwkSKey, const char *_appSKey)
+void LoRaWanPacketBase::personalize(const char *_devAddr, const char *_nwkSKey, const char *_appSKey)
 {
   uint8_t devAddr[4];
   uint8_t nwkSKey[16];
@@ -159,311 +224,344 @@ void LoRaWanPacketClass::personalize(const char *_devAddr, const char *_nwkSKey,
   LORA_HEX_TO_BYTE((char *)devAddr, (char *) _devAddr, 4);
   LORA_HEX_TO_BYTE((char *)nwkSKey, (char *) _nwkSKey, 16);
   LORA_HEX_TO_BYTE((char *)appSKey, (char *) _appSKey, 16);
-  memcpy(DevAddr, devAddr, 4);
-  memcpy(NwkSKey, nwkSKey, 16);
-  memcpy(AppSKey, appSKey, 16);
+  SessionSetKeys(&Session, devAddr, nwkSKey, appSKey);
+  clearKeystream();
 }
 
-void LoRaWanPacketClass::show()
+void LoRaWanPacketBase::show()
 {
   Serial.print("DevEui: ");
-  _LORA_HEX_PRINTLN(Serial, DevEui, 8);
+  _LORA_HEX_PRINTLN(Serial, Identity.DevEui, 8);
   Serial.print("AppEui: ");
-  _LORA_HEX_PRINTLN(Serial, AppEui, 8);
+  _LORA_HEX_PRINTLN(Serial, Identity.AppEui, 8);
   Serial.print("AppKey: ");
-  _LORA_HEX_PRINTLN(Serial, AppKey, 16);
+  _LORA_HEX_PRINTLN(Serial, Identity.AppKey, 16);
 
   Serial.print("DevAddr: ");
-  _LORA_HEX_PRINTLN(Serial, DevAddr, 4);
+  _LORA_HEX_PRINTLN(Serial, Session.DevAddr, 4);
+  // the session keys are the first round key of each schedule
   Serial.print("NwkSKey: ");
-  _LORA_HEX_PRINTLN(Serial, NwkSKey, 16);
+  _LORA_HEX_PRINTLN(Serial, Session.NwkSKey.Context.Round_Key, 16);
   Serial.print("AppSKey: ");
-  _LORA_HEX_PRINTLN(Serial, AppSKey, 16);
+  _LORA_HEX_PRINTLN(Serial, Session.AppSKey.Round_Key, 16);
 
   Serial.print("Packet: ");
-  _LORA_HEX_PRINTLN(Serial, payload_buf, payload_len);
+  _LORA_HEX_PRINTLN(Serial, buffer(), length());
 }
 
 // ----------------------------------------------------------------------------
 // setPort
 // ----------------------------------------------------------------------------
-void LoRaWanPacketClass::setPort(uint8_t port)
+void LoRaWanPacketBase::setPort(uint8_t port)
 {
   FPort = port;
 }
 
-// ----------------------------------------------------------------------------
-// DevStatusReq = 0x06,       // u1:battery 0,1-254,255=?, u1:7-6:RFU,5-0:margin(-32..31)
-// ----------------------------------------------------------------------------
-bool LoRaWanPacketClass::IsDevStatusReq()
-{
-  bool isMac = lastMac == 0x06;
-  if (isMac) lastMac = 0x00;
-  return isMac;
-}
-
-// ----------------------------------------------------------------------------
-// CHECKDEV
-// Function to check the DEVICE
-// Parameters:
-//  - buf: LoRa buffer to check in bytes, 1...5 bytes contain the DEVICE
-//  - len: Length of buffer in bytes
-//
-// ----------------------------------------------------------------------------
-boolean LoRaWanPacketClass::checkDev(uint8_t *buf, uint8_t len)
-{
-  if (buf[1] == DevAddr[3])
-    if (buf[2] == DevAddr[2])
-      if (buf[3] == DevAddr[1])
-        if (buf[4] == DevAddr[0])
-        {
-          return true;
-        }
-  return false;
-}
-
-// ----------------------------------------------------------------------------
-// CHECKMIC
-// Function to check the MIC computed for existing messages and for new messages
-// Parameters:
-//  - buf: LoRa buffer to check in bytes, last 4 bytes contain the MIC
-//  - len: Length of buffer in bytes
-//  - key: Key to use for MIC. Normally this is the NwkSKey
-//
-// ----------------------------------------------------------------------------
-boolean LoRaWanPacketClass::checkMic(uint8_t *buf, uint8_t len, uint8_t *key)
-{
-  uint8_t cBuf[len + 1];
-
-  for (uint8_t i = 0; i < len - 4; i++)
-    cBuf[i] = buf[i];
-  len -= 4;
-
-  uint16_t count = (cBuf[7] * 256) + cBuf[6];
-  uint8_t dir = 0;
-  if (buf[0] == 0x60 || buf[0] == 0xA0)
-  {
-    dir = 1;
-    if (buf[0] == 0xA0) FCtrl = FCT_ACK;
-    else FCtrl = 0x00;
-  }
-
-  len += PayloadComputeMic(cBuf, len, key, count, dir);
-
-  if (buf[len - 4] == cBuf[len - 4])
-    if (buf[len - 3] == cBuf[len - 3])
-      if (buf[len - 2] == cBuf[len - 2])
-        if (buf[len - 1] == cBuf[len - 1])
-        {
-          return true;
-        }
-#ifdef LORAWAN_DEBUG
-  if (debug)
-    Serial.println("Check Mic Error");
-#endif
-
-  return false;
-}
-
 // ----------------------------------------------------------------------------
 // decode buffer
 // ----------------------------------------------------------------------------
-int16_t LoRaWanPacketClass::decode()
+int16_t LoRaWanPacketBase::decode()
 {
-  return decode(payload_buf, payload_len);
+  // a LoRa frame is at most 255 bytes
+  if (length() > 255)
+    return 0;
+  return decode(buffer(), length());
 }
 
 // ----------------------------------------------------------------------------
 // decode
 // ----------------------------------------------------------------------------
-int16_t LoRaWanPacketClass::decode(uint8_t *buf, uint8_t len)
+int16_t LoRaWanPacketBase::decode(uint8_t *buf, uint8_t len)
 {
 
 #ifdef LORAWAN_DEBUG
     if (debug)
     {
       Serial.print("Decode: ");
-      _LORA_HEX_PRINTLN(Serial, payload_buf, payload_len);
+      _LORA_HEX_PRINTLN(Serial, buf, len);
     }
 #endif
 
+  int16_t ret;
+  CRYPTO_TIME_START(t);
   // join decode
   if (buf[0] == 0x20)
-    return decodeJoin(buf, len);
+  {
+    ret = decodeJoin(buf, len);
+    CRYPTO_TIME_STOP(Stats.Join, t);
+    return ret;
+  }
   // others decodes
-  return decodePacket(buf, len);
+  ret = decodePacket(buf, len);
+  CRYPTO_TIME_STOP(Stats.Decode, t);
+  return ret;
+}
+
+// ----------------------------------------------------------------------------
+// decode view
+// Decodes buf without copying it to payload_buf, the offsets of every field
+// of the frame are set in view.
+// ----------------------------------------------------------------------------
+LoRaWanStatus LoRaWanPacketBase::decode(uint8_t *buf, uint8_t len, LoRaWanView *view)
+{
+  CRYPTO_TIME_START(t);
+  if (len > 0 && buf[0] == 0x20)
+  {
+    decodeAccept(buf, len, view);
+    CRYPTO_TIME_STOP(Stats.Join, t);
+    return view->Status;
+  }
+  decodeFrame(buf, len, view);
+  CRYPTO_TIME_STOP(Stats.Decode, t);
+  return view->Status;
 }
 
 // ----------------------------------------------------------------------------
 // decodePacket
 // ----------------------------------------------------------------------------
-int16_t LoRaWanPacketClass::decodePacket(uint8_t *buf, uint8_t len)
+int16_t LoRaWanPacketBase::decodePacket(uint8_t *buf, uint8_t len)
 {
-  // check devid
-  if (checkDev(buf, len) == false)
-    return -1;
+  LoRaWanView view;
 
-  // check mic
-  if (checkMic(buf, len, NwkSKey))
+  switch (decodeFrame(buf, len, &view))
   {
-    uint16_t count = (buf[7] * 256) + buf[6];
-    uint8_t dir = 0;
+    case LORAWAN_OK:
+      break;
+    case LORAWAN_UNKNOWN_DEVICE:
+      return -1;
+    case LORAWAN_REPLAY:
+      return -2;
+    default:
+      return 0;
+  }
 
-    // downlink code 0x60
-    if (buf[0] == 0x60)
-      dir = 1;
+  uint8_t fport = (view.FPort) ? buf[view.FPort] : 0;
 
-    // downlink confirm 0xA0
-    if (buf[0] == 0xA0)
-      dir = 1;
+  // buf is inside payload_buf, the payload is read where it was decrypted
+  payload_position = (buf - payload_buf) + view.Payload;
+  payload_len = payload_position + view.PayloadLen;
 
-    if (dir == 1)
-    {
-      if (frameCountDown > count)
-      {
-        // frame down menor que count
-        // downlink antigo
-        // ignorar payload
-        FCtrl = 0x00;
-        return -2;
-      }
-      frameCountDown = count + 1;
-    }
-
-    // Add fctrl optional bytes / ignore
-    uint8_t fctrl_opt = (buf[5] & FCT_OPTLEN);
-    uint8_t fport = 0;//buf[8 + fctrl_opt];
-    uint8_t mlength = 9 + fctrl_opt;
+#ifdef LORAWAN_DEBUG
+  if (debug)
+  {
+    Serial.print("Payload: ");
+    _LORA_HEX_PRINTLN(Serial, buffer(), length());
+  }
+#endif
 
-    payload_position = 0;
-    payload_len = 0;
+  return fport;
+}
 
-    len = len - 4; // remove MIC
-    bool containPayload = (len > mlength);
+// ----------------------------------------------------------------------------
+// decodeFrame
+// Checks the device, MIC and frame counter and decrypts the payload in place
+// ----------------------------------------------------------------------------
+LoRaWanStatus LoRaWanPacketBase::decodeFrame(uint8_t *buf, uint8_t len, LoRaWanView *view)
+{
+  // the device only takes downlinks, 0x60 and 0xA0; an uplink, even its own
+  // echoed back, is not checked against FCntUp
+  if (len > 0 && buf[0] != 0x60 && buf[0] != 0xA0)
+  {
+    memset(view, 0, sizeof(LoRaWanView));
+    return view->Status = LORAWAN_BAD_FRAME;
+  }
 
-    if (containPayload) // With Payload
-    {
-      payload_len = len - mlength;
-      fport = buf[8 + fctrl_opt];
-    }
+  LoRaWanStatus status = SessionDecode(&Session, buf, len, view);
 
-    for (size_t i = 0; i < fctrl_opt; i++)
-    {
-      uint8_t mac = buf[(containPayload) ? 9 : 8 + i];
-      Serial.print("mac: ");
-      Serial.println(mac, HEX);
-      if (mac == 0x06) lastMac = mac;
-    }
+  if (view->Dir == 1)
+  {
+    // downlink confirm 0xA0 asks for an ACK on the next uplink, an old
+    // downlink is ignored
+    if (status == LORAWAN_OK && buf[0] == 0xA0)
+      FCtrl = FCT_ACK;
+    else
+      FCtrl = 0x00;
+  }
 
+  if (status != LORAWAN_OK)
+  {
+#ifdef LORAWAN_STATS
+    if (status == LORAWAN_BAD_MIC)
+      Stats.MicFailures++;
+    else if (status == LORAWAN_REPLAY)
+      Stats.Replays++;
+#endif
+#if LORAWAN_EVENTS > 0
+    if (status == LORAWAN_BAD_MIC)
+      EventsPush(&Events, LORAWAN_EVENT_MIC_ERROR, 0, (buf[7] * 256) + buf[6]);
+    else if (status == LORAWAN_REPLAY)
+      EventsPush(&Events, LORAWAN_EVENT_REPLAY, 0, (uint16_t)view->FCnt);
+#endif
 #ifdef LORAWAN_DEBUG
-    if (debug)
-    {
-      Serial.print("fctrl_opt: ");
-      Serial.println(fctrl_opt);
-      Serial.print("fport: ");
-      Serial.println(fport);
-      Serial.print("payload_len: ");
-      Serial.println(payload_len);
-      Serial.print("FCtrl: ");
-      Serial.println(FCtrl, HEX);
-      Serial.print("lastMac: ");
-      Serial.println(lastMac, HEX);
-    }
+    if (debug && status == LORAWAN_BAD_MIC)
+      Serial.println("Check Mic Error");
 #endif
+    return status;
+  }
 
-    PayloadEncode((uint8_t *)(buf + mlength), payload_len, AppSKey, DevAddr, count, dir);
+  uint8_t fctrl_opt = view->FOptsLen;
 
-    // modifica para payload
-    memcpy(payload_buf, (uint8_t *)(buf + mlength), payload_len);
+  // MAC commands come in FOpts or, encrypted with the NwkSKey, on port 0
+  Mac.Received = 0;
+  decodeMac(buf + view->FOpts, fctrl_opt, view->FCnt);
+  if (view->FPort != 0 && buf[view->FPort] == 0)
+    decodeMac(buf + view->Payload, view->PayloadLen, view->FCnt);
 
 #ifdef LORAWAN_DEBUG
-    if (debug)
-    {
-      Serial.print("Payload: ");
-      _LORA_HEX_PRINTLN(Serial, payload_buf, payload_len);
-    }
+  if (debug)
+  {
+    Serial.print("fctrl_opt: ");
+    Serial.println(fctrl_opt);
+    Serial.print("fport: ");
+    Serial.println((view->FPort) ? buf[view->FPort] : 0);
+    Serial.print("payload_len: ");
+    Serial.println(view->PayloadLen);
+    Serial.print("FCtrl: ");
+    Serial.println(FCtrl, HEX);
+    Serial.print("Mac: ");
+    Serial.println(Mac.Received, HEX);
+  }
 #endif
 
-    return fport;
+  return status;
+}
+
+// ----------------------------------------------------------------------------
+// decodeMac
+// Walks the MAC commands of buf once, each one updates Mac through the
+// command table of LoRaWanMac. An unknown CID ends the walk, its length
+// and so the start of the next command are unknown.
+// ----------------------------------------------------------------------------
+void LoRaWanPacketBase::decodeMac(uint8_t *buf, uint8_t len, uint32_t fcnt)
+{
+  uint8_t i = 0;
+  while (i < len)
+  {
+    uint8_t n = MacCommand(&Mac, buf + i, len - i);
+    if (n == 0)
+      break;
+#if LORAWAN_EVENTS > 0
+    EventsPush(&Events, LORAWAN_EVENT_MAC, buf[i], (uint16_t)fcnt);
+#endif
+    i += n;
   }
-  return 0;
 }
 
 // ----------------------------------------------------------------------------
 // decodeJoin
 // ----------------------------------------------------------------------------
-int16_t LoRaWanPacketClass::decodeJoin(uint8_t *buf, uint8_t len)
+int16_t LoRaWanPacketBase::decodeJoin(uint8_t *buf, uint8_t len)
 {
-  JoinDecrypt(buf + 1, len - 1, AppKey);
+  LoRaWanView view;
 
-  if (JoinComputeMic(buf, len - 4, AppKey))
+  if (decodeAccept(buf, len, &view) != LORAWAN_JOIN_ACCEPT)
+    return 0;
+
+  clear();
+  return PORT_OTAA_JOIN_ACCEPT;
+}
+
+// ----------------------------------------------------------------------------
+// decodeAccept
+// Decrypts a join accept in place and checks its MIC, the keys of the new
+// session are derived from it. Only buf is touched, not payload_buf.
+// ----------------------------------------------------------------------------
+LoRaWanStatus LoRaWanPacketBase::decodeAccept(uint8_t *buf, uint8_t len, LoRaWanView *view)
+{
+  memset(view, 0, sizeof(LoRaWanView));
+  view->Dir = 1;
+
+  // MHDR, 12 or 28 encrypted bytes with the CFList, and the MIC; the
+  // decryption works on whole blocks
+  if (len != 17 && len != 33)
+    return view->Status = LORAWAN_BAD_FRAME;
+
+  JoinDecrypt(buf + 1, len - 1, &Identity.AppKeyCmac.Context);
+
+  if (JoinCheckMic(buf, len - 4, &Identity.AppKeyCmac))
   {
+    uint8_t devAddr[4];
+    uint8_t nwkSKey[16];
+    uint8_t appSKey[16];
+
     for (int i = 0; i < 4; i++)
-      DevAddr[3 - i] = buf[7 + i];
+      devAddr[3 - i] = buf[7 + i];
 
-    JoinComputeSKeys(AppKey, buf + 1, DevNonce, NwkSKey, AppSKey);
+    JoinComputeSKeys(&Identity.AppKeyCmac.Context, buf + 1, Identity.DevNonce, nwkSKey, appSKey);
+    SessionSetKeys(&Session, devAddr, nwkSKey, appSKey);
+    clearKeystream();
+    // answers to the old session are not sent in the new one
+    Mac.QueueLen = 0;
 
 #ifdef LORAWAN_DEBUG
     if (debug)
     {
       Serial.print("DevAddr: ");
-      _LORA_HEX_PRINTLN(Serial, DevAddr, 4);
+      _LORA_HEX_PRINTLN(Serial, Session.DevAddr, 4);
       Serial.print("NwkSKey: ");
-      _LORA_HEX_PRINTLN(Serial, NwkSKey, 16);
+      _LORA_HEX_PRINTLN(Serial, nwkSKey, 16);
       Serial.print("AppSKey: ");
-      _LORA_HEX_PRINTLN(Serial, AppSKey, 16);
+      _LORA_HEX_PRINTLN(Serial, appSKey, 16);
     }
 #endif
 
-    clear();
-    return PORT_OTAA_JOIN_ACCEPT;
+    view->Payload = 1;
+    view->PayloadLen = len - 5;
+    return view->Status = LORAWAN_JOIN_ACCEPT;
   }
-  return 0;
+#ifdef LORAWAN_STATS
+  Stats.MicFailures++;
+#endif
+#if LORAWAN_EVENTS > 0
+  EventsPush(&Events, LORAWAN_EVENT_MIC_ERROR, 0, 0);
+#endif
+  return view->Status = LORAWAN_BAD_MIC;
 }
 
-void LoRaWanPacketClass::randomJoin(){
+void LoRaWanPacketBase::randomJoin(){
   
   for(size_t i = 0; i < 4; i++)
   {
-    DevAddr[i] = 0;
+    Session.DevAddr[i] = 0;
   }
-  DevNonce = (uint16_t)random(255) << 8 | (uint16_t)random(255);
-  frameCountDown = 0;
-  frameCount = 0;
+  Identity.DevNonce = (uint16_t)random(255) << 8 | (uint16_t)random(255);
+  Session.FCntDown = 0;
+  Session.FCntUp = 0;
+  clearKeystream();
 }
 
-bool LoRaWanPacketClass::isJoin(){
-  if (DevAddr[3] == 0 && DevAddr[2] == 0 && DevAddr[1] == 0 && DevAddr[0] == 0) 
+bool LoRaWanPacketBase::isJoin(){
+  if (Session.DevAddr[3] == 0 && Session.DevAddr[2] == 0 && Session.DevAddr[1] == 0 && Session.DevAddr[0] == 0) 
     return true;
   return false;
 }
 
 
-int16_t LoRaWanPacketClass::JoinPacket()
+int16_t LoRaWanPacketBase::JoinPacket()
 {
-  if (DevNonce == 0) 
+  if (Identity.DevNonce == 0) 
   {
-    DevNonce = (uint16_t)random(255) << 8 | (uint16_t)random(255);
+    Identity.DevNonce = (uint16_t)random(255) << 8 | (uint16_t)random(255);
   }
 
   payload_buf[0] = 0x00;
 
-  DevNonce++;
+  Identity.DevNonce++;
 
-  memset(DevAddr, 0, 4);
-  memset(NwkSKey, 0, 16);
-  memset(AppSKey, 0, 16);
+  SessionClear(&Session);
+  clearKeystream();
 
   for (uint8_t i = 0; i < 8; i++)
-    payload_buf[i + 1] = AppEui[7 - i];
+    payload_buf[i + 1] = Identity.AppEui[7 - i];
 
   for (uint8_t i = 0; i < 8; i++)
-    payload_buf[i + 1 + 8] = DevEui[7 - i];
+    payload_buf[i + 1 + 8] = Identity.DevEui[7 - i];
 
-  payload_buf[17] = (DevNonce & 0x00FF);
-  payload_buf[18] = ((DevNonce >> 8) & 0x00FF);
+  payload_buf[17] = (Identity.DevNonce & 0x00FF);
+  payload_buf[18] = ((Identity.DevNonce >> 8) & 0x00FF);
+  payload_position = 0;
   payload_len = 19;
-  JoinComputeMic(payload_buf, payload_len, AppKey);
+  JoinComputeMic(payload_buf, payload_len, &Identity.AppKeyCmac);
   payload_len += 4;
 
 #ifdef LORAWAN_DEBUG
@@ -498,30 +596,79 @@ int16_t LoRaWanPacketClass::JoinPacket()
 // So message size should be lass than 128 bytes if Payload is limited to 64 bytes.
 // ----------------------------------------------------------------------------
 
-int16_t LoRaWanPacketClass::encode()
+int16_t LoRaWanPacketBase::encode()
+{
+  CRYPTO_TIME_START(t);
+  int16_t ret = encoder(FPort);
+  CRYPTO_TIME_STOP(Stats.Encode, t);
+  return ret;
+}
+
+// ----------------------------------------------------------------------------
+// encode fragments
+// The payload is the fragments one after the other, encrypted straight into
+// the frame; what was written to the packet is dropped.
+// ----------------------------------------------------------------------------
+int16_t LoRaWanPacketBase::encode(const Payload_Fragment *fragments, uint8_t num)
 {
-  return encoder(FPort);
+  CRYPTO_TIME_START(t);
+  int16_t ret = encoder(FPort, fragments, num);
+  CRYPTO_TIME_STOP(Stats.Encode, t);
+  return ret;
 }
 
-int16_t LoRaWanPacketClass::encoder(byte fport)
+int16_t LoRaWanPacketBase::encoder(byte fport, const Payload_Fragment *fragments, uint8_t num)
 {
-  if (DevAddr[3] == 0 && DevAddr[2] == 0 && DevAddr[1] == 0 && DevAddr[0] == 0)
+  if (Session.DevAddr[3] == 0 && Session.DevAddr[2] == 0 && Session.DevAddr[1] == 0 && Session.DevAddr[0] == 0)
     return JoinPacket();
 
   if (fport > 0)
     FPort = fport;
 
-  uint8_t mac = 0; // Force DevStatusReq Mac
-  if (IsDevStatusReq()) mac = 3;
-  
-  uint8_t mlength = 9 + mac;
+  // Pending MAC answers go in FOpts, as many whole commands as fit. Only
+  // when they do not fit there and there is no payload to send, they take
+  // the payload on port 0 instead.
+  uint8_t port = FPort;
+  uint8_t mac = 0;
 
-  uint8_t buf[payload_len + 1 + mac];
-  // fix payload > 9
-  memcpy((uint8_t *)(buf), payload_buf, payload_len);
-  memcpy((uint8_t *)(payload_buf + mlength), buf, payload_len);
+  if (fragments)
+    clear();
+  else if (!headroom())
+    return 0;
+
+  // MHDR, FHDR without FOpts, FPort and MIC take 13 of the 255 bytes a LoRa
+  // frame can have, the MIC goes after the payload
+  uint32_t total = payload_len - payload_position;
+  for (uint8_t f = 0; fragments && f < num; f++)
+    total += fragments[f].Length;
+  if (total > 255 - 13 || payload_position + total + 4 > payload_size)
+    return 0;
+  uint16_t n = total;
+  uint16_t tail = payload_size - payload_position - n;
+
+  // the answers the application did not confirm accept the settings, as a
+  // sketch that never calls MacAnswer() expects
+  if (!Mac.Hold)
+    MacAccept(&Mac);
+
+  // only the answers ready to go count, not the ones held
+  if (n == 0 && MacQueueFit(&Mac, LORAWAN_MAC_QUEUE) > MAC_FOPTS_MAX)
+  {
+    port = 0;
+    fragments = NULL;
+    n = MacQueueFit(&Mac, (tail - 4 < 255 - 13) ? tail - 4 : 255 - 13);
+    memcpy(payload_buf + payload_position, Mac.Queue, n);
+    MacQueueDrop(&Mac, n);
+  }
+  else
+  {
+    uint8_t room = 255 - 13 - n;
+    mac = MacQueueFit(&Mac, (room < MAC_FOPTS_MAX) ? room : MAC_FOPTS_MAX);
+  }
 
-  //memcpy((uint8_t *)(payload_buf + 9), payload_buf, payload_len);
+  // The header ends right before the payload, inside the headroom
+  uint8_t mlength = 9 + mac;
+  uint8_t *frame = payload_buf + payload_position - mlength;
 
   // In the next few bytes the fake LoRa message must be put
   // PHYPayload = MHDR | MACPAYLOAD | MIC
@@ -530,37 +677,31 @@ int16_t LoRaWanPacketClass::encoder(byte fport)
 
   // ------------------------------
   // MHDR (Para 4.2), bit 5-7 MType, bit 2-4 RFU, bit 0-1 Major
-  payload_buf[0] = 0x40; // MHDR 0x40 == unconfirmed up message,
-                         // FRU and major are 0
+  frame[0] = 0x40; // MHDR 0x40 == unconfirmed up message,
+                   // FRU and major are 0
 
   // -------------------------------
   // FHDR consists of 4 bytes addr, 1 byte Fctrl, 2 byte FCnt, 0-15 byte FOpts
   // We support ABP addresses only for Gateways
-  payload_buf[1] = DevAddr[3]; // Last byte[3] of address
-  payload_buf[2] = DevAddr[2];
-  payload_buf[3] = DevAddr[1];
-  payload_buf[4] = DevAddr[0]; // First byte[0] of Dev_Addr
+  frame[1] = Session.DevAddr[3]; // Last byte[3] of address
+  frame[2] = Session.DevAddr[2];
+  frame[3] = Session.DevAddr[1];
+  frame[4] = Session.DevAddr[0]; // First byte[0] of Dev_Addr
 
-  payload_buf[5] = FCtrl + mac;               // FCtrl is normally 0
-  payload_buf[6] = frameCount % 0x100; // LSB
-  payload_buf[7] = frameCount / 0x100; // MSB
+  frame[5] = FCtrl + mac;            // FCtrl is normally 0
+  frame[6] = Session.FCntUp % 0x100; // LSB
+  frame[7] = Session.FCntUp / 0x100; // MSB
 
   FCtrl = 0x00; // clear FCtrl
 
   // -------------------------------
   // FPort, either 0 or 1 bytes. Must be != 0 for non MAC messages such as user payload
   //
-  payload_buf[8+mac] = FPort; // FPort must not be 0
+  frame[8+mac] = port;
 
-  // DevStatusReq = 0x06,       // u1:battery 0,1-254,255=?, u1:7-6:RFU,5-0:margin(-32..31)
-  if (IsDevStatusReq())
-  {
-    payload_buf[8] = 0x06;
-    payload_buf[9] = 0xFF;
-    uint8_t snr = 0b00100000;
-    payload_buf[10] = (uint8_t)(0b00111111 & snr);
-    mac = 0;
-  }
+  // FOpts, the answers sent leave the queue
+  memcpy(frame + 8, Mac.Queue, mac);
+  MacQueueDrop(&Mac, mac);
 
   // FRMPayload; Payload will be AES128 encoded using AppSKey
   // See LoRa spec para 4.3.2
@@ -569,28 +710,107 @@ int16_t LoRaWanPacketClass::encoder(byte fport)
   // Payload bytes in this example are encoded in the LoRaCode(c) format
 
   // we have to include the AES functions at this stage in order to generate LoRa Payload.
-  if (payload_len > 0) {
-    uint8_t CodeLength = PayloadEncode((uint8_t *)(payload_buf + mlength), payload_len, AppSKey, DevAddr, frameCount, 0);
-    mlength += CodeLength; // length inclusive sensor data
-  }
-  // MIC, Message Integrity Code
-  // As MIC is used by TTN (and others) we have to make sure that
-  // framecount is valid and the message is correctly encrypted.
-  // Note: Until MIC is done correctly, TTN does not receive these messages
-  //     The last 4 bytes are MIC bytes.
+  // The MIC, Message Integrity Code, is computed in the same pass over the
+  // encrypted payload. As MIC is used by TTN (and others) we have to make
+  // sure that framecount is valid and the message is correctly encrypted.
+  // The last 4 bytes are MIC bytes.
   //
+  if (fragments == NULL && port != 0 && n > 0 && useKeystream(frame + mlength, n))
+  {
+    mlength += n;
+    mlength += PayloadComputeMic(frame, mlength, &Session.NwkSKey, Session.FCntUp, 0);
+  }
+  else
+  {
+    Payload_Fragment written = {frame + mlength, n};
+    if (fragments == NULL)
+    {
+      fragments = &written;
+      num = 1;
+    }
+    AES_Context *key = (port == 0) ? &Session.NwkSKey.Context : &Session.AppSKey;
+    mlength = PayloadEncodeMic(frame, mlength, fragments, num, key, &Session.NwkSKey, Session.DevAddr, Session.FCntUp, 0);
+  }
 
-  mlength += PayloadComputeMic((uint8_t *)(payload_buf), mlength, NwkSKey, frameCount, 0);
-
-  frameCount++;
-  payload_len = mlength;
+  Session.FCntUp++;
+  payload_position = frame - payload_buf;
+  payload_len = payload_position + mlength;
 
 #ifdef LORAWAN_DEBUG
   if (debug)
     Serial.print("Encode: ");
-    _LORA_HEX_PRINTLN(Serial, payload_buf, payload_len);
+    _LORA_HEX_PRINTLN(Serial, buffer(), length());
 #endif
   return 1;
 }
 
+#if LORAWAN_EVENTS > 0
+// ----------------------------------------------------------------------------
+// readEvent
+// decode() records events instead of printing them, so a slow Serial does
+// not delay the receive path. Drain them from loop(), Events.Dropped counts
+// the ones lost while the ring was full.
+// ----------------------------------------------------------------------------
+bool LoRaWanPacketBase::readEvent(LoRaWanEvent *event)
+{
+  return EventsPop(&Events, event);
+}
+#endif
+
+// ----------------------------------------------------------------------------
+// precompute
+// The A blocks of an uplink only depend on DevAddr, AppSKey and FCntUp,
+// so the keystream of the next LORAWAN_KEYSTREAM_FRAMES uplinks can be
+// encrypted ahead, leaving only a XOR for encode().
+// ----------------------------------------------------------------------------
+void LoRaWanPacketBase::precompute()
+{
+#if LORAWAN_KEYSTREAM_FRAMES > 0
+  if (isJoin())
+    return;
+
+  for (uint8_t i = 0; i < LORAWAN_KEYSTREAM_FRAMES; i++)
+  {
+    uint32_t count = Session.FCntUp + i;
+    uint8_t slot = count % LORAWAN_KEYSTREAM_FRAMES;
+    if (keystreamValid[slot] && keystreamCount[slot] == count)
+      continue;
+    memset(keystream[slot], 0, LORAWAN_KEYSTREAM_SIZE);
+    PayloadEncode(keystream[slot], LORAWAN_KEYSTREAM_SIZE, &Session.AppSKey, Session.DevAddr, count, 0);
+    keystreamCount[slot] = count;
+    keystreamValid[slot] = true;
+  }
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// useKeystream
+// Encrypt the payload of the current uplink with the precomputed keystream,
+// returns false when it is not available and PayloadEncode() is needed.
+// ----------------------------------------------------------------------------
+bool LoRaWanPacketBase::useKeystream(uint8_t *buf, uint16_t len)
+{
+#if LORAWAN_KEYSTREAM_FRAMES > 0
+  uint8_t slot = Session.FCntUp % LORAWAN_KEYSTREAM_FRAMES;
+  if (len > LORAWAN_KEYSTREAM_SIZE || !keystreamValid[slot] || keystreamCount[slot] != Session.FCntUp)
+    return false;
+
+  for (uint16_t i = 0; i < len; i++)
+    buf[i] ^= keystream[slot][i];
+  keystreamValid[slot] = false;
+  return true;
+#else
+  (void)buf;
+  (void)len;
+  return false;
+#endif
+}
+
+void LoRaWanPacketBase::clearKeystream()
+{
+#if LORAWAN_KEYSTREAM_FRAMES > 0
+  memset(keystreamValid, 0, sizeof(keystreamValid));
+#endif
+}
+
 LoRaWanPacketClass LoRaWanPacket;
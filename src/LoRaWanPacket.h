@@ -16,40 +16,100 @@
 #include <Arduino.h>
 #include "crypto/LoRaUtilities.h"
 #include "crypto/LoRaMacCrypto.h"
+#include "crypto/CryptoStats.h"
+#include "LoRaWanSession.h"
+#include "LoRaWanEvents.h"
+#include "LoRaWanMac.h"
+#include "LoRaWanEncoder.h"
+
+// ----------------------------------------------------------------------------
+// LORAWAN_BUF_SIZE, LORAWAN_KEYSTREAM_*, LORAWAN_EVENTS, LORAWAN_MAC_QUEUE
+// and LORAWAN_CACHE_LINE size members of LoRaWanPacketBase. The library .cpp
+// files are compiled on their own and never see a #define in the sketch,
+// which would then disagree with them on the layout of the class: change
+// them here or as build flags of the whole build. LORAWAN_STATS and
+// LORAWAN_REPLAY_WINDOW keep the layout and only switch code, but they
+// likewise only take effect as build flags.
+// ----------------------------------------------------------------------------
+
+// Frame buffer of LoRaWanPacketClass and of the LoRaWanPacket instance, other
+// sizes are LoRaWanPacketSized<SIZE>; 143 takes a 115 byte uplink payload,
+// and a received frame of 143 bytes, a 130 byte downlink payload
+#ifndef LORAWAN_BUF_SIZE
+#define LORAWAN_BUF_SIZE 143
+#endif
 
-#define LORAWAN_BUF_SIZE 128
+// Bytes kept free in front of the payload written to the packet, the most
+// encode() puts there: MHDR, FHDR with 15 bytes of FOpts, and FPort
+#define LORAWAN_HEADROOM (1 + 7 + 15 + 1)
 
 #define PORT_OTAA_JOIN_ACCEPT 500
 
+// Uplink frames of keystream precompute() keeps ready, 0 disables the cache
+#ifndef LORAWAN_KEYSTREAM_FRAMES
+#define LORAWAN_KEYSTREAM_FRAMES 0
+#endif
+
+// Payload bytes of keystream kept for each frame
+#ifndef LORAWAN_KEYSTREAM_SIZE
+#define LORAWAN_KEYSTREAM_SIZE 16
+#endif
+
 //#define LORAWAN_DEBUG true;
 
-class LoRaWanPacketClass : public Stream{
+// Frame level counters and stage timings, the crypto ones are in CryptoStats;
+// left at 0 without LORAWAN_STATS
+typedef struct {
+	uint32_t MicFailures;
+	uint32_t Replays;
+	Crypto_Timing Encode;       // encode()
+	Crypto_Timing Decode;       // decode() of data frames
+	Crypto_Timing Join;         // decode() of join accepts
+} LoRaWanStats;
+
+// ----------------------------------------------------------------------------
+// Everything but the frame buffer, which the derived LoRaWanPacketSized
+// holds, so the code is built once for every buffer size.
+// ----------------------------------------------------------------------------
+class LoRaWanPacketBase : public Stream{
 public:
 
-	uint8_t debug = 1;
+	// ----------------------------------------------- //
+	// DevAddr, frame counters and key schedules, Session.FCntUp is the
+	// next uplink sent and Session.FCntDown the next downlink accepted
+	LoRaWanSession Session;
 
-	uint32_t frameCount = 0;
-	uint32_t frameCountDown = 0;
+	uint8_t debug = 1;
 	uint8_t FPort = 0x01;
 	uint8_t FCtrl = 0x00;
-	uint8_t lastMac = 0x00;
 
 	// ----------------------------------------------- //
-	uint8_t DevEui[8];
-	uint8_t AppEui[8];
-	uint8_t AppKey[16];
-	uint16_t DevNonce = 0x0000;
-	
+	// settings asked by the MAC commands of the last downlinks and the
+	// answers waiting for the next uplinks
+	LoRaWanMac Mac;
+
 	// ----------------------------------------------- //
-	uint8_t DevAddr[4];
-	uint8_t NwkSKey[16];
-	uint8_t AppSKey[16];
+	// DevEui, AppEui, AppKey and DevNonce, only used to join
+	LoRaWanIdentity Identity;
+
+#if LORAWAN_KEYSTREAM_FRAMES > 0
+	// keystream of the next uplinks, slot FCntUp % LORAWAN_KEYSTREAM_FRAMES
+	uint8_t keystream[LORAWAN_KEYSTREAM_FRAMES][LORAWAN_KEYSTREAM_SIZE];
+	uint32_t keystreamCount[LORAWAN_KEYSTREAM_FRAMES];
+	bool keystreamValid[LORAWAN_KEYSTREAM_FRAMES];
+#endif
 
-	uint8_t payload_buf[LORAWAN_BUF_SIZE];
-	uint8_t payload_len = 0;
-	uint8_t payload_position = 0;
+	LoRaWanStats Stats;
 
-	LoRaWanPacketClass();
+#if LORAWAN_EVENTS > 0
+	// MAC commands, MIC errors and replays seen by decode(), see readEvent()
+	LoRaWanEvents Events;
+#endif
+
+	uint8_t *payload_buf;
+	uint16_t payload_size;
+	uint16_t payload_len;
+	uint16_t payload_position;
 
 	int begin();
 	void end();
@@ -89,6 +149,27 @@ public:
 	// decode/encode functions
 	int16_t decode();
 	int16_t encode();
+
+	// encode a payload made of num fragments, read where they are
+	int16_t encode(const Payload_Fragment *fragments, uint8_t num);
+
+	// encode the SIZE bytes written with FPort, or port 0 for MAC_PORT, with a
+	// frame layout fixed at compile time, 0 when not exactly SIZE bytes were
+	// written; pending MAC answers wait for encode()
+	template <uint8_t SIZE, bool MAC_PORT = false>
+	int16_t encodeFixed();
+
+	// decode a frame in place, the payload is left decrypted inside buf
+	LoRaWanStatus decode(uint8_t *buf, uint8_t len, LoRaWanView *view);
+
+	// fill the keystream of the next uplinks, call it when idle
+	void precompute();
+
+#if LORAWAN_EVENTS > 0
+	// take the oldest decode event, call it from loop() and not the radio
+	// interrupt; returns false when there is none
+	bool readEvent(LoRaWanEvent *event);
+#endif
 	
 	void randomJoin();
 
@@ -100,16 +181,71 @@ private:
 	// decode/encode functions
 	int16_t decode(uint8_t *buf, uint8_t len);
 	int16_t decodePacket(uint8_t *buf, uint8_t len);
+	LoRaWanStatus decodeFrame(uint8_t *buf, uint8_t len, LoRaWanView *view);
 	int16_t decodeJoin(uint8_t *buf, uint8_t len);
-	int16_t encoder(byte fport = 0);
+	LoRaWanStatus decodeAccept(uint8_t *buf, uint8_t len, LoRaWanView *view);
+	int16_t encoder(byte fport = 0, const Payload_Fragment *fragments = NULL, uint8_t num = 0);
+
+	void decodeMac(uint8_t *buf, uint8_t len, uint32_t fcnt);
+
+	bool front();
+	bool headroom();
+
+	// keystream cache
+	bool useKeystream(uint8_t *buf, uint16_t len);
+	void clearKeystream();
+
+protected:
+
+	LoRaWanPacketBase(uint8_t *buf, uint16_t size);
+
+private:
+
+	// payload_buf belongs to the derived object
+	LoRaWanPacketBase(const LoRaWanPacketBase &) = delete;
+	LoRaWanPacketBase &operator=(const LoRaWanPacketBase &) = delete;
+};
+
+// ----------------------------------------------------------------------------
+// LoRaWanPacketSized
+// Parameters:
+//  - SIZE: Bytes of the frame buffer, LORAWAN_HEADROOM of them in front of
+//    the payload and 4 after it for the MIC. A 242 byte payload at DR4 US915
+//    needs 270; a node that only sends a few bytes can go down to 57, a join
+//    accept with its CFList behind the headroom.
+// ----------------------------------------------------------------------------
+template <uint16_t SIZE>
+class LoRaWanPacketSized : public LoRaWanPacketBase{
+public:
+	static_assert(SIZE >= LORAWAN_HEADROOM + 33, "The buffer holds at least a join accept behind the headroom");
 
-	// check functions
-	boolean checkDev(uint8_t *buf, uint8_t len);
-	boolean checkMic(uint8_t *buf, uint8_t len, uint8_t *key);
+	LoRaWanPacketSized() : LoRaWanPacketBase(frame, SIZE) {}
 
-	bool IsDevStatusReq();
+private:
+	uint8_t frame[SIZE];
 };
 
+typedef LoRaWanPacketSized<LORAWAN_BUF_SIZE> LoRaWanPacketClass;
+
+template <uint8_t SIZE, bool MAC_PORT>
+int16_t LoRaWanPacketBase::encodeFixed()
+{
+	typedef LoRaWanUplink<0, MAC_PORT, SIZE> Frame;
+
+	if (isJoin())
+		return JoinPacket();
+
+	// the payload stays where it was written, the header goes in front of
+	// it; a payload of any other size would be cut or padded
+	if (!headroom() || payload_len - payload_position != SIZE || payload_position + SIZE + 4 > payload_size)
+		return 0;
+
+	payload_position -= Frame::Payload;
+	payload_len = payload_position + Frame::encode(&Session, payload_buf + payload_position, FCtrl, NULL, FPort, NULL);
+	FCtrl = 0x00;
+	return 1;
+}
+
 extern LoRaWanPacketClass LoRaWanPacket;
 
 #endif
@@ -0,0 +1,198 @@
+// ----------------------------------------------- //
+// LoRaWanSession.cpp
+// ----------------------------------------------- //
+//
+// Plain session records, without Stream or buffers,
+// shared by LoRaWanPacket and LoRaWanSessionTable
+//
+// ----------------------------------------------- //
+
+#include <Arduino.h>
+#include "crypto/LoRaUtilities.h"
+#include "LoRaWanSession.h"
+#include "crypto/CryptoStats.h"
+
+// ----------------------------------------------------------------------------
+// SessionSetKeys
+// Parameters:
+//  - devAddr: DevAddr, most significant byte first
+//  - nwkSKey, appSKey: Session keys, expanded into the record
+//
+// The frame counters restart at 0.
+// ----------------------------------------------------------------------------
+void SessionSetKeys(LoRaWanSession *session, uint8_t *devAddr, uint8_t *nwkSKey, uint8_t *appSKey)
+{
+  CRYPTO_TIME_START(t);
+  memcpy(session->DevAddr, devAddr, 4);
+  session->FCntUp = 0;
+  session->FCntDown = 0;
+  session->WindowUp = 0;
+  session->WindowDown = 0;
+  generate_cmac_key(&session->NwkSKey, nwkSKey);
+  AES_Expand_Key(&session->AppSKey, appSKey);
+  CRYPTO_TIME_STOP(CryptoStats.Keys, t);
+}
+
+void SessionClear(LoRaWanSession *session)
+{
+  memset(session, 0, sizeof(LoRaWanSession));
+}
+
+uint32_t SessionDevAddr(LoRaWanSession *session)
+{
+  return ((uint32_t)session->DevAddr[0] << 24) | ((uint32_t)session->DevAddr[1] << 16) | ((uint32_t)session->DevAddr[2] << 8) | session->DevAddr[3];
+}
+
+// ----------------------------------------------------------------------------
+// SessionCounterCandidates
+// Function to rebuild the 32-bit frame counter from the 16 bits in FCnt
+// Parameters:
+//  - count: Filled with the candidates, up to MIC_MAX_CANDIDATES
+//  - fcnt: 16-bit FCnt of the frame
+//  - last: Next frame counter expected
+//
+// The candidates are the counters ending in fcnt that are ahead of last by
+// at most LORAWAN_FCNT_MAX_GAP. When fcnt is behind last in the current upper
+// half, that old counter goes first, so a replayed frame is still recognized;
+// so does one from the previous upper half still inside the replay window,
+// for a late frame sent just before the lower 16 bits wrapped.
+// Returns the number of candidates.
+// ----------------------------------------------------------------------------
+uint8_t SessionCounterCandidates(uint32_t *count, uint16_t fcnt, uint32_t last)
+{
+  uint8_t n = 0;
+  uint32_t c = (last & 0xFFFF0000) | fcnt;
+
+  if (c < last)
+  {
+    count[n++] = c;
+    c += 0x10000;
+  }
+  else if (c >= 0x10000 && last - (c - 0x10000) <= LORAWAN_REPLAY_WINDOW)
+  {
+    count[n++] = c - 0x10000;
+  }
+
+  while (n < MIC_MAX_CANDIDATES && c >= last && (c - last) <= LORAWAN_FCNT_MAX_GAP)
+  {
+    count[n++] = c;
+    c += 0x10000;
+  }
+  return n;
+}
+
+// ----------------------------------------------------------------------------
+// SessionAccept
+// Parameters:
+//  - next: Next frame counter expected, one past the highest received
+//  - window: Bitmap of the LORAWAN_REPLAY_WINDOW counters below next
+//  - count: Frame counter with a valid MIC
+//
+// A counter from next on moves the window forward, one inside the window is
+// accepted only if its bit is still clear. Returns false for a replay.
+// ----------------------------------------------------------------------------
+static bool SessionAccept(uint32_t *next, uint32_t *window, uint32_t count)
+{
+#if LORAWAN_REPLAY_WINDOW > 0
+  if (count < *next)
+  {
+    uint32_t age = *next - 1 - count;
+    if (age >= LORAWAN_REPLAY_WINDOW || (*window & ((uint32_t)1 << age)))
+      return false;
+    *window |= (uint32_t)1 << age;
+    return true;
+  }
+
+  uint32_t shift = count - *next + 1;
+  *window = ((shift < 32) ? (*window << shift) : 0) | 1;
+#else
+  (void)window;
+  if (count < *next)
+    return false;
+#endif
+  *next = count + 1;
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+// SessionDecode
+// Parameters:
+//  - session: Session of the device that sent or receives the frame
+//  - buf: LoRaWan frame, the payload is decrypted in place
+//  - len: Length of the frame in bytes
+//  - view: Set to the status and the offsets of the fields inside buf
+//
+// Uplinks are checked against FCntUp and downlinks against FCntDown, the
+// counter moves past the frame only when the MIC matches and it is not a
+// replay. A late frame inside the replay window is accepted once. FPort 0
+// payloads are MAC commands and use the NwkSKey.
+// ----------------------------------------------------------------------------
+LoRaWanStatus SessionDecode(LoRaWanSession *session, uint8_t *buf, uint8_t len, LoRaWanView *view)
+{
+  memset(view, 0, sizeof(LoRaWanView));
+
+  // MHDR, FHDR and MIC at least
+  if (len < 12)
+    return view->Status = LORAWAN_BAD_FRAME;
+
+  uint8_t dir;
+  switch (buf[0])
+  {
+    case 0x40:
+    case 0x80:
+      dir = 0;
+      break;
+    case 0x60:
+    case 0xA0:
+      dir = 1;
+      break;
+    default:
+      return view->Status = LORAWAN_BAD_FRAME;
+  }
+
+  uint8_t fctrl_opt = (buf[5] & FCT_OPTLEN);
+  uint8_t mlength = 8 + fctrl_opt;
+  if (len < mlength + 4)
+    return view->Status = LORAWAN_BAD_FRAME;
+
+  if (buf[1] != session->DevAddr[3] || buf[2] != session->DevAddr[2] || buf[3] != session->DevAddr[1] || buf[4] != session->DevAddr[0])
+    return view->Status = LORAWAN_UNKNOWN_DEVICE;
+
+  uint32_t *next = (dir == 1) ? &session->FCntDown : &session->FCntUp;
+  uint32_t *window = (dir == 1) ? &session->WindowDown : &session->WindowUp;
+  uint32_t candidates[MIC_MAX_CANDIDATES];
+  uint16_t fcnt = (buf[7] * 256) + buf[6];
+  uint8_t n = SessionCounterCandidates(candidates, fcnt, *next);
+
+  len -= 4; // remove MIC
+  uint8_t i = PayloadMatchMic(buf, len, &session->NwkSKey, candidates, n, dir, buf + len);
+  if (i >= n)
+    return view->Status = LORAWAN_BAD_MIC;
+
+  uint32_t count = candidates[i];
+  view->Dir = dir;
+  view->FCnt = count;
+  if (!SessionAccept(next, window, count))
+    return view->Status = LORAWAN_REPLAY;
+
+  view->FOpts = 8;
+  view->FOptsLen = fctrl_opt;
+  view->Payload = len;
+  if (len > mlength)
+  {
+    view->FPort = mlength;
+    view->Payload = mlength + 1;
+    view->PayloadLen = len - view->Payload;
+    PayloadEncode(buf + view->Payload, view->PayloadLen, (buf[mlength] == 0) ? &session->NwkSKey.Context : &session->AppSKey, session->DevAddr, count, dir);
+  }
+
+  return view->Status = LORAWAN_OK;
+}
+
+void IdentitySetAppKey(LoRaWanIdentity *identity, uint8_t *appKey)
+{
+  CRYPTO_TIME_START(t);
+  memcpy(identity->AppKey, appKey, 16);
+  generate_cmac_key(&identity->AppKeyCmac, identity->AppKey);
+  CRYPTO_TIME_STOP(CryptoStats.Keys, t);
+}
@@ -0,0 +1,105 @@
+// ----------------------------------------------- //
+// LoRaWanSession.h
+// ----------------------------------------------- //
+//
+// Plain session records, without Stream or buffers,
+// shared by LoRaWanPacket and LoRaWanSessionTable
+//
+// ----------------------------------------------- //
+
+#ifndef LORAWAN_SESSION_H
+#define LORAWAN_SESSION_H
+
+#include <Arduino.h>
+#include "crypto/LoRaMacCrypto.h"
+
+// Largest jump accepted between the expected and the received frame counter,
+// the upper 16 bits of the counter are rebuilt inside this window
+#ifndef LORAWAN_FCNT_MAX_GAP
+#define LORAWAN_FCNT_MAX_GAP 16384
+#endif
+
+// Frame counters below the highest one received that are still accepted
+// once, out of order, 0...32; 0 only accepts increasing counters. The
+// windows stay in LoRaWanSession either way.
+#ifndef LORAWAN_REPLAY_WINDOW
+#define LORAWAN_REPLAY_WINDOW 32
+#endif
+
+// Alignment of the hot session record, a cache line on a host build whose
+// new honours over-aligned types (C++17). It moves every field after the
+// session, so only set it for the whole build.
+#ifndef LORAWAN_CACHE_LINE
+#if !defined(ARDUINO) && defined(__cpp_aligned_new)
+#define LORAWAN_CACHE_LINE 64
+#else
+#define LORAWAN_CACHE_LINE 0
+#endif
+#endif
+
+#if LORAWAN_CACHE_LINE > 1
+#define LORAWAN_ALIGNED __attribute__((aligned(LORAWAN_CACHE_LINE)))
+#else
+#define LORAWAN_ALIGNED
+#endif
+
+typedef enum {
+    LORAWAN_OK = 0,             // data frame checked and decrypted
+    LORAWAN_JOIN_ACCEPT,        // join accept, session keys derived
+    LORAWAN_BAD_FRAME,          // too short or not a data frame
+    LORAWAN_UNKNOWN_DEVICE,     // DevAddr does not match
+    LORAWAN_BAD_MIC,            // no frame counter gives the MIC
+    LORAWAN_REPLAY,             // frame counter already seen
+} LoRaWanStatus;
+
+// ----------------------------------------------------------------------------
+// Decoded frame, as offsets into the caller's buffer:
+//  MHDR(0) | FHDR(1 .. FOpts+FOptsLen-1) | FPort | FRMPayload | MIC(4)
+// FPort is 0 when the frame has no port and payload.
+// ----------------------------------------------------------------------------
+typedef struct {
+    LoRaWanStatus Status;
+    uint8_t Dir;                // 0 uplink, 1 downlink
+    uint32_t FCnt;              // rebuilt 32-bit frame counter
+    uint8_t FOpts;
+    uint8_t FOptsLen;
+    uint8_t FPort;
+    uint8_t Payload;
+    uint8_t PayloadLen;
+} LoRaWanView;
+
+// ----------------------------------------------------------------------------
+// Hot part, read for every frame. The counters and their replay windows sit
+// in the first cache line next to DevAddr, followed by the key schedules in the order a decode reads
+// them. The session keys themselves are the first round key of each schedule.
+// ----------------------------------------------------------------------------
+typedef struct LORAWAN_ALIGNED {
+	uint8_t DevAddr[4];         // most significant byte first
+	uint32_t FCntUp;            // next uplink counter
+	uint32_t FCntDown;          // next downlink counter
+	uint32_t WindowUp;          // bit i: counter FCntUp - 1 - i received
+	uint32_t WindowDown;        // bit i: counter FCntDown - 1 - i received
+	CMAC_Key NwkSKey;           // MIC and FPort 0 payloads
+	AES_Context AppSKey;        // application payloads
+} LoRaWanSession;
+
+// ----------------------------------------------------------------------------
+// Cold part, only read to build or answer a join
+// ----------------------------------------------------------------------------
+typedef struct {
+	uint8_t DevEui[8];
+	uint8_t AppEui[8];
+	uint8_t AppKey[16];
+	uint16_t DevNonce;
+	CMAC_Key AppKeyCmac;        // key schedule and CMAC subkeys of AppKey
+} LoRaWanIdentity;
+
+void SessionSetKeys(LoRaWanSession *session, uint8_t *devAddr, uint8_t *nwkSKey, uint8_t *appSKey);
+void SessionClear(LoRaWanSession *session);
+uint32_t SessionDevAddr(LoRaWanSession *session);
+uint8_t SessionCounterCandidates(uint32_t *count, uint16_t fcnt, uint32_t last);
+LoRaWanStatus SessionDecode(LoRaWanSession *session, uint8_t *buf, uint8_t len, LoRaWanView *view);
+
+void IdentitySetAppKey(LoRaWanIdentity *identity, uint8_t *appKey);
+
+#endif
@@ -0,0 +1,271 @@
+// ----------------------------------------------- //
+// LoRaWanSessionTable.cpp
+// ----------------------------------------------- //
+//
+// Session table for the network side, decodes the
+// frames of many devices keyed by DevAddr
+//
+// ----------------------------------------------- //
+
+#include <Arduino.h>
+#include "crypto/LoRaUtilities.h"
+#include "LoRaWanSessionTable.h"
+
+#if LORAWAN_THREADS
+#include <thread>
+#endif
+
+// ----------------------------------------------------------------------------
+// The sessions are kept packed in one array and found through an open
+// addressing index with linear probing. The index holds at least twice the
+// capacity, so probes stay short, and each entry carries the DevAddr, so a
+// lookup reads the index line only and then the one session it hits.
+// Pointers to sessions are valid until the next remove(). A capacity over
+// 2^30, whose index would not fit the 32-bit mask, leaves the table empty.
+// ----------------------------------------------------------------------------
+LoRaWanSessionTable::LoRaWanSessionTable(uint32_t capacity)
+{
+  if (capacity > ((uint32_t)1 << 30) || capacity > SIZE_MAX / sizeof(LoRaWanSession))
+    capacity = 0;
+
+  uint32_t n = 2;
+  while (n < capacity * 2)
+    n <<= 1;
+
+#if LORAWAN_CACHE_LINE > 1 && !defined(ARDUINO)
+  if (posix_memalign((void **) &sessions, LORAWAN_CACHE_LINE, capacity * sizeof(LoRaWanSession)) != 0)
+    sessions = NULL;
+#else
+  sessions = (LoRaWanSession *) malloc(capacity * sizeof(LoRaWanSession));
+#endif
+  index = (Entry *) calloc(n, sizeof(Entry));
+  mask = n - 1;
+  count = 0;
+  limit = (sessions && index) ? capacity : 0;
+}
+
+LoRaWanSessionTable::~LoRaWanSessionTable()
+{
+  free(sessions);
+  free(index);
+}
+
+uint32_t LoRaWanSessionTable::size()
+{
+  return count;
+}
+
+uint32_t LoRaWanSessionTable::capacity()
+{
+  return limit;
+}
+
+uint32_t LoRaWanSessionTable::hash(uint32_t devAddr)
+{
+  // NwkID sits in the top bits, mix them into the low bits used by the mask
+  devAddr *= 0x9E3779B1;
+  return (devAddr ^ (devAddr >> 16)) & mask;
+}
+
+// ----------------------------------------------------------------------------
+// lookup
+// Returns the entry of devAddr, or the empty entry where it would go
+// ----------------------------------------------------------------------------
+LoRaWanSessionTable::Entry *LoRaWanSessionTable::lookup(uint32_t devAddr)
+{
+  uint32_t i = hash(devAddr);
+  while (index[i].Slot != 0 && index[i].DevAddr != devAddr)
+    i = (i + 1) & mask;
+  return &index[i];
+}
+
+LoRaWanSession *LoRaWanSessionTable::find(uint32_t devAddr)
+{
+  if (limit == 0)
+    return NULL;
+  Entry *e = lookup(devAddr);
+  if (e->Slot == 0)
+    return NULL;
+  return &sessions[e->Slot - 1];
+}
+
+LoRaWanSession *LoRaWanSessionTable::add(uint32_t devAddr, uint8_t *nwkSKey, uint8_t *appSKey)
+{
+  if (limit == 0)
+    return NULL;
+
+  Entry *e = lookup(devAddr);
+  if (e->Slot == 0)
+  {
+    if (count == limit)
+      return NULL;
+    e->DevAddr = devAddr;
+    e->Slot = ++count;
+  }
+
+  uint8_t addr[4];
+  addr[0] = (devAddr >> 24) & 0xFF;
+  addr[1] = (devAddr >> 16) & 0xFF;
+  addr[2] = (devAddr >> 8) & 0xFF;
+  addr[3] = (devAddr) & 0xFF;
+
+  LoRaWanSession *s = &sessions[e->Slot - 1];
+  SessionSetKeys(s, addr, nwkSKey, appSKey);
+  return s;
+}
+
+LoRaWanSession *LoRaWanSessionTable::add(const char *_devAddr, const char *_nwkSKey, const char *_appSKey)
+{
+  uint32_t devAddr;
+  uint8_t nwkSKey[16];
+  uint8_t appSKey[16];
+  LORA_HEX_TO_DEVICE(devAddr, (char *) _devAddr);
+  LORA_HEX_TO_BYTE((char *)nwkSKey, (char *) _nwkSKey, 16);
+  LORA_HEX_TO_BYTE((char *)appSKey, (char *) _appSKey, 16);
+  return add(devAddr, nwkSKey, appSKey);
+}
+
+// ----------------------------------------------------------------------------
+// remove
+// The last session moves into the free slot so the array stays packed, and
+// the following index entries shift back so no probe chain is broken.
+// ----------------------------------------------------------------------------
+bool LoRaWanSessionTable::remove(uint32_t devAddr)
+{
+  if (limit == 0)
+    return false;
+
+  Entry *e = lookup(devAddr);
+  if (e->Slot == 0)
+    return false;
+
+  uint32_t slot = e->Slot;
+  if (slot != count)
+  {
+    LoRaWanSession *last = &sessions[count - 1];
+    sessions[slot - 1] = *last;
+    lookup(SessionDevAddr(last))->Slot = slot;
+  }
+  count--;
+
+  uint32_t i = e - index;
+  uint32_t j = i;
+  index[i].Slot = 0;
+  while (true)
+  {
+    j = (j + 1) & mask;
+    if (index[j].Slot == 0)
+      break;
+    uint32_t k = hash(index[j].DevAddr);
+    // move j back to i unless its home k lies cyclically in (i, j]
+    if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+      continue;
+    index[i] = index[j];
+    index[j].Slot = 0;
+    i = j;
+  }
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+// decode
+// Parameters:
+//  - buf: LoRaWan frame, the payload is decrypted in place
+//  - len: Length of the frame in bytes
+//  - view: Set to the status and the offsets of the fields inside buf
+// ----------------------------------------------------------------------------
+LoRaWanStatus LoRaWanSessionTable::decode(uint8_t *buf, uint8_t len, LoRaWanView *view)
+{
+  LoRaWanSession *s = NULL;
+  if (len >= 5)
+    s = find(((uint32_t)buf[4] << 24) | ((uint32_t)buf[3] << 16) | ((uint32_t)buf[2] << 8) | buf[1]);
+
+  if (s == NULL)
+  {
+    memset(view, 0, sizeof(LoRaWanView));
+    return view->Status = (len < 12) ? LORAWAN_BAD_FRAME : LORAWAN_UNKNOWN_DEVICE;
+  }
+  return SessionDecode(s, buf, len, view);
+}
+
+int16_t LoRaWanSessionTable::decode(uint8_t *buf, uint8_t len, uint8_t **payload, uint8_t *payload_len)
+{
+  LoRaWanView view;
+
+  switch (decode(buf, len, &view))
+  {
+    case LORAWAN_OK:
+      break;
+    case LORAWAN_UNKNOWN_DEVICE:
+      return -1;
+    case LORAWAN_REPLAY:
+      return -2;
+    default:
+      return 0;
+  }
+
+  if (payload)
+    *payload = buf + view.Payload;
+  if (payload_len)
+    *payload_len = view.PayloadLen;
+
+  return (view.FPort) ? buf[view.FPort] : 0;
+}
+
+// ----------------------------------------------------------------------------
+// decodeBatch
+// Parameters:
+//  - frames: Frames to decode, view is filled
+//  - num: Number of frames
+//  - threads: Worker threads, 0 uses one per core
+//
+// Each DevAddr belongs to exactly one worker, which decodes its frames in
+// array order. The counter checks of a session therefore run in the order
+// the frames arrived, and no session is shared between threads, so the
+// workers need no locks.
+// ----------------------------------------------------------------------------
+void LoRaWanSessionTable::decodeBatch(LoRaWanFrame *frames, uint32_t num, uint8_t threads)
+{
+#if LORAWAN_THREADS
+  if (threads == 0)
+  {
+    unsigned int cores = std::thread::hardware_concurrency();
+    threads = (cores == 0) ? 1 : (cores > 255) ? 255 : cores;
+  }
+  if (threads > num)
+    threads = (num == 0) ? 1 : num;
+
+  if (threads > 1)
+  {
+    std::thread *pool = new std::thread[threads - 1];
+    for (uint8_t i = 1; i < threads; i++)
+      pool[i - 1] = std::thread(&LoRaWanSessionTable::decodeWorker, this, frames, num, i, threads);
+    decodeWorker(frames, num, 0, threads);
+    for (uint8_t i = 1; i < threads; i++)
+      pool[i - 1].join();
+    delete[] pool;
+    return;
+  }
+#else
+  (void)threads;
+#endif
+  decodeWorker(frames, num, 0, 1);
+}
+
+void LoRaWanSessionTable::decodeWorker(LoRaWanFrame *frames, uint32_t num, uint8_t worker, uint8_t workers)
+{
+  for (uint32_t i = 0; i < num; i++)
+  {
+    LoRaWanFrame *f = &frames[i];
+    uint8_t owner = 0;
+    if (f->len >= 5)
+    {
+      uint32_t devAddr = ((uint32_t)f->buf[4] << 24) | ((uint32_t)f->buf[3] << 16) | ((uint32_t)f->buf[2] << 8) | f->buf[1];
+      owner = hash(devAddr) % workers;
+    }
+    if (owner != worker)
+      continue;
+
+    decode(f->buf, f->len, &f->view);
+  }
+}
@@ -0,0 +1,79 @@
+// ----------------------------------------------- //
+// LoRaWanSessionTable.h
+// ----------------------------------------------- //
+//
+// Session table for the network side, decodes the
+// frames of many devices keyed by DevAddr
+//
+// ----------------------------------------------- //
+
+#ifndef LORAWAN_SESSION_TABLE_H
+#define LORAWAN_SESSION_TABLE_H
+
+#include <Arduino.h>
+#include "LoRaWanSession.h"
+
+// decodeBatch() spreads the frames over worker threads on a host build,
+// Arduino cores decode the batch in the calling loop
+#ifndef LORAWAN_THREADS
+#if !defined(ARDUINO) && (defined(__linux__) || defined(__APPLE__))
+#define LORAWAN_THREADS 1
+#else
+#define LORAWAN_THREADS 0
+#endif
+#endif
+
+typedef struct {
+	uint8_t *buf;               // frame, decrypted in place
+	uint8_t len;
+	LoRaWanView view;           // set by decodeBatch()
+} LoRaWanFrame;
+
+class LoRaWanSessionTable {
+public:
+
+	LoRaWanSessionTable(uint32_t capacity);
+	~LoRaWanSessionTable();
+
+	// add or replace the keys of a device, counters restart at 0
+	LoRaWanSession *add(uint32_t devAddr, uint8_t *nwkSKey, uint8_t *appSKey);
+	LoRaWanSession *add(const char *_devAddr, const char *_nwkSKey, const char *_appSKey);
+	bool remove(uint32_t devAddr);
+	LoRaWanSession *find(uint32_t devAddr);
+
+	uint32_t size();
+	uint32_t capacity();
+
+	// check and decrypt a frame in place, returns the same codes as LoRaWanPacketClass::decode:
+	// fport, 0 bad frame or MIC, -1 unknown device, -2 replay; or the status and field offsets
+	int16_t decode(uint8_t *buf, uint8_t len, uint8_t **payload = NULL, uint8_t *payload_len = NULL);
+	LoRaWanStatus decode(uint8_t *buf, uint8_t len, LoRaWanView *view);
+
+	// decode a batch of frames, frames of the same device keep their order;
+	// sessions must not be added or removed while it runs
+	void decodeBatch(LoRaWanFrame *frames, uint32_t num, uint8_t threads = 0);
+
+private:
+
+	// index entry, DevAddr is kept here so a probe never touches the sessions
+	typedef struct {
+		uint32_t DevAddr;
+		uint32_t Slot;          // session + 1, 0 is an empty entry
+	} Entry;
+
+	LoRaWanSession *sessions;
+	Entry *index;
+	uint32_t mask;
+	uint32_t count;
+	uint32_t limit;
+
+	uint32_t hash(uint32_t devAddr);
+	Entry *lookup(uint32_t devAddr);
+	void decodeWorker(LoRaWanFrame *frames, uint32_t num, uint8_t worker, uint8_t workers);
+
+	// sessions and index belong to this table
+	LoRaWanSessionTable(const LoRaWanSessionTable &) = delete;
+	LoRaWanSessionTable &operator=(const LoRaWanSessionTable &) = delete;
+};
+
+#endif
@@ -0,0 +1,467 @@
+// ----------------------------------------------- //
+// AES-128_Bitslice.cpp
+// ----------------------------------------------- //
+//
+// Bitsliced constant time AES-128 encryption of 8
+// blocks per pass, selected with AES_USE_BITSLICE in
+// AES-128_V10.h. A single block or a short pass runs
+// the same 8 block circuit.
+//
+// The 8 blocks are spread over 8 slices, slice n has
+// bit n of every byte of every block. A slice is two
+// 64-bit lanes of 4 blocks each, held in one SSE2 (or
+// NEON) register through the GCC vector extension.
+// SubBytes is the Boyar-Peralta boolean circuit, so no
+// table is indexed with secret data.
+//
+// The layout inside a lane and the S-box circuit follow
+// the well known "ct64" construction from BearSSL.
+//
+// ----------------------------------------------- //
+
+#include <stdint.h>
+#include <string.h>
+#include "AES-128_V10.h"
+
+#if defined(AES_USE_BITSLICE)
+
+#define AES_LANES 2
+
+#define AES_LOAD32(p) ((uint32_t)(p)[0] | ((uint32_t)(p)[1] << 8) | ((uint32_t)(p)[2] << 16) | ((uint32_t)(p)[3] << 24))
+
+#define AES_STORE32(p, v) \
+do { \
+  (p)[0] = (unsigned char)(v); \
+  (p)[1] = (unsigned char)((v) >> 8); \
+  (p)[2] = (unsigned char)((v) >> 16); \
+  (p)[3] = (unsigned char)((v) >> 24); \
+} while (0)
+
+static inline AES_Slice AES_Splat(uint64_t x)
+{
+  AES_Slice v = { x, x };
+  return v;
+}
+
+// ----------------------------------------------- //
+// bit transposition of the 8 slices
+// ----------------------------------------------- //
+
+#define AES_SWAPN(cl, ch, s, x, y) \
+do { \
+  AES_Slice a = (x), b = (y); \
+  (x) = (a & AES_Splat(cl)) | ((b & AES_Splat(cl)) << (s)); \
+  (y) = ((a & AES_Splat(ch)) >> (s)) | (b & AES_Splat(ch)); \
+} while (0)
+
+#define AES_SWAP2(x, y) AES_SWAPN(0x5555555555555555ULL, 0xAAAAAAAAAAAAAAAAULL, 1, x, y)
+#define AES_SWAP4(x, y) AES_SWAPN(0x3333333333333333ULL, 0xCCCCCCCCCCCCCCCCULL, 2, x, y)
+#define AES_SWAP8(x, y) AES_SWAPN(0x0F0F0F0F0F0F0F0FULL, 0xF0F0F0F0F0F0F0F0ULL, 4, x, y)
+
+static void AES_Ortho(AES_Slice *q)
+{
+  AES_SWAP2(q[0], q[1]);
+  AES_SWAP2(q[2], q[3]);
+  AES_SWAP2(q[4], q[5]);
+  AES_SWAP2(q[6], q[7]);
+
+  AES_SWAP4(q[0], q[2]);
+  AES_SWAP4(q[1], q[3]);
+  AES_SWAP4(q[4], q[6]);
+  AES_SWAP4(q[5], q[7]);
+
+  AES_SWAP8(q[0], q[4]);
+  AES_SWAP8(q[1], q[5]);
+  AES_SWAP8(q[2], q[6]);
+  AES_SWAP8(q[3], q[7]);
+}
+
+// spread the 4 words of a block over two 64-bit words
+static void AES_Interleave_In(uint64_t *q0, uint64_t *q1, const uint32_t *w)
+{
+  uint64_t x0, x1, x2, x3;
+
+  x0 = w[0];
+  x1 = w[1];
+  x2 = w[2];
+  x3 = w[3];
+  x0 |= (x0 << 16);
+  x1 |= (x1 << 16);
+  x2 |= (x2 << 16);
+  x3 |= (x3 << 16);
+  x0 &= 0x0000FFFF0000FFFFULL;
+  x1 &= 0x0000FFFF0000FFFFULL;
+  x2 &= 0x0000FFFF0000FFFFULL;
+  x3 &= 0x0000FFFF0000FFFFULL;
+  x0 |= (x0 << 8);
+  x1 |= (x1 << 8);
+  x2 |= (x2 << 8);
+  x3 |= (x3 << 8);
+  x0 &= 0x00FF00FF00FF00FFULL;
+  x1 &= 0x00FF00FF00FF00FFULL;
+  x2 &= 0x00FF00FF00FF00FFULL;
+  x3 &= 0x00FF00FF00FF00FFULL;
+  *q0 = x0 | (x2 << 8);
+  *q1 = x1 | (x3 << 8);
+}
+
+static void AES_Interleave_Out(uint32_t *w, uint64_t q0, uint64_t q1)
+{
+  uint64_t x0, x1, x2, x3;
+
+  x0 = q0 & 0x00FF00FF00FF00FFULL;
+  x1 = q1 & 0x00FF00FF00FF00FFULL;
+  x2 = (q0 >> 8) & 0x00FF00FF00FF00FFULL;
+  x3 = (q1 >> 8) & 0x00FF00FF00FF00FFULL;
+  x0 |= (x0 >> 8);
+  x1 |= (x1 >> 8);
+  x2 |= (x2 >> 8);
+  x3 |= (x3 >> 8);
+  x0 &= 0x0000FFFF0000FFFFULL;
+  x1 &= 0x0000FFFF0000FFFFULL;
+  x2 &= 0x0000FFFF0000FFFFULL;
+  x3 &= 0x0000FFFF0000FFFFULL;
+  w[0] = (uint32_t)x0 | (uint32_t)(x0 >> 16);
+  w[1] = (uint32_t)x1 | (uint32_t)(x1 >> 16);
+  w[2] = (uint32_t)x2 | (uint32_t)(x2 >> 16);
+  w[3] = (uint32_t)x3 | (uint32_t)(x3 >> 16);
+}
+
+// ----------------------------------------------- //
+// round functions
+// ----------------------------------------------- //
+
+static void AES_Sub_Bytes(AES_Slice *q)
+{
+  AES_Slice x0, x1, x2, x3, x4, x5, x6, x7;
+  AES_Slice y1, y2, y3, y4, y5, y6, y7, y8, y9;
+  AES_Slice y10, y11, y12, y13, y14, y15, y16, y17, y18, y19;
+  AES_Slice y20, y21;
+  AES_Slice z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+  AES_Slice z10, z11, z12, z13, z14, z15, z16, z17;
+  AES_Slice t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+  AES_Slice t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+  AES_Slice t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+  AES_Slice t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+  AES_Slice t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+  AES_Slice t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+  AES_Slice t60, t61, t62, t63, t64, t65, t66, t67;
+  AES_Slice s0, s1, s2, s3, s4, s5, s6, s7;
+
+  x0 = q[7];
+  x1 = q[6];
+  x2 = q[5];
+  x3 = q[4];
+  x4 = q[3];
+  x5 = q[2];
+  x6 = q[1];
+  x7 = q[0];
+
+  // top linear transformation
+  y14 = x3 ^ x5;
+  y13 = x0 ^ x6;
+  y9 = x0 ^ x3;
+  y8 = x0 ^ x5;
+  t0 = x1 ^ x2;
+  y1 = t0 ^ x7;
+  y4 = y1 ^ x3;
+  y12 = y13 ^ y14;
+  y2 = y1 ^ x0;
+  y5 = y1 ^ x6;
+  y3 = y5 ^ y8;
+  t1 = x4 ^ y12;
+  y15 = t1 ^ x5;
+  y20 = t1 ^ x1;
+  y6 = y15 ^ x7;
+  y10 = y15 ^ t0;
+  y11 = y20 ^ y9;
+  y7 = x7 ^ y11;
+  y17 = y10 ^ y11;
+  y19 = y10 ^ y8;
+  y16 = t0 ^ y11;
+  y21 = y13 ^ y16;
+  y18 = x0 ^ y16;
+
+  // non-linear section
+  t2 = y12 & y15;
+  t3 = y3 & y6;
+  t4 = t3 ^ t2;
+  t5 = y4 & x7;
+  t6 = t5 ^ t2;
+  t7 = y13 & y16;
+  t8 = y5 & y1;
+  t9 = t8 ^ t7;
+  t10 = y2 & y7;
+  t11 = t10 ^ t7;
+  t12 = y9 & y11;
+  t13 = y14 & y17;
+  t14 = t13 ^ t12;
+  t15 = y8 & y10;
+  t16 = t15 ^ t12;
+  t17 = t4 ^ t14;
+  t18 = t6 ^ t16;
+  t19 = t9 ^ t14;
+  t20 = t11 ^ t16;
+  t21 = t17 ^ y20;
+  t22 = t18 ^ y19;
+  t23 = t19 ^ y21;
+  t24 = t20 ^ y18;
+
+  t25 = t21 ^ t22;
+  t26 = t21 & t23;
+  t27 = t24 ^ t26;
+  t28 = t25 & t27;
+  t29 = t28 ^ t22;
+  t30 = t23 ^ t24;
+  t31 = t22 ^ t26;
+  t32 = t31 & t30;
+  t33 = t32 ^ t24;
+  t34 = t23 ^ t33;
+  t35 = t27 ^ t33;
+  t36 = t24 & t35;
+  t37 = t36 ^ t34;
+  t38 = t27 ^ t36;
+  t39 = t29 & t38;
+  t40 = t25 ^ t39;
+
+  t41 = t40 ^ t37;
+  t42 = t29 ^ t33;
+  t43 = t29 ^ t40;
+  t44 = t33 ^ t37;
+  t45 = t42 ^ t41;
+  z0 = t44 & y15;
+  z1 = t37 & y6;
+  z2 = t33 & x7;
+  z3 = t43 & y16;
+  z4 = t40 & y1;
+  z5 = t29 & y7;
+  z6 = t42 & y11;
+  z7 = t45 & y17;
+  z8 = t41 & y10;
+  z9 = t44 & y12;
+  z10 = t37 & y3;
+  z11 = t33 & y4;
+  z12 = t43 & y13;
+  z13 = t40 & y5;
+  z14 = t29 & y2;
+  z15 = t42 & y9;
+  z16 = t45 & y14;
+  z17 = t41 & y8;
+
+  // bottom linear transformation
+  t46 = z15 ^ z16;
+  t47 = z10 ^ z11;
+  t48 = z5 ^ z13;
+  t49 = z9 ^ z10;
+  t50 = z2 ^ z12;
+  t51 = z2 ^ z5;
+  t52 = z7 ^ z8;
+  t53 = z0 ^ z3;
+  t54 = z6 ^ z7;
+  t55 = z16 ^ z17;
+  t56 = z12 ^ t48;
+  t57 = t50 ^ t53;
+  t58 = z4 ^ t46;
+  t59 = z3 ^ t54;
+  t60 = t46 ^ t57;
+  t61 = z14 ^ t57;
+  t62 = t52 ^ t58;
+  t63 = t49 ^ t58;
+  t64 = z4 ^ t59;
+  t65 = t61 ^ t62;
+  t66 = z1 ^ t63;
+  s0 = t59 ^ t63;
+  s6 = t56 ^ ~t62;
+  s7 = t48 ^ ~t60;
+  t67 = t64 ^ t65;
+  s3 = t53 ^ t66;
+  s4 = t51 ^ t66;
+  s5 = t47 ^ t65;
+  s1 = t64 ^ ~s3;
+  s2 = t55 ^ ~t67;
+
+  q[7] = s0;
+  q[6] = s1;
+  q[5] = s2;
+  q[4] = s3;
+  q[3] = s4;
+  q[2] = s5;
+  q[1] = s6;
+  q[0] = s7;
+}
+
+static void AES_Shift_Rows(AES_Slice *q)
+{
+  for (unsigned char i = 0; i < 8; i++)
+  {
+    AES_Slice x = q[i];
+    q[i] = (x & AES_Splat(0x000000000000FFFFULL))
+      | ((x & AES_Splat(0x00000000FFF00000ULL)) >> 4)
+      | ((x & AES_Splat(0x00000000000F0000ULL)) << 12)
+      | ((x & AES_Splat(0x0000FF0000000000ULL)) >> 8)
+      | ((x & AES_Splat(0x000000FF00000000ULL)) << 8)
+      | ((x & AES_Splat(0xF000000000000000ULL)) >> 12)
+      | ((x & AES_Splat(0x0FFF000000000000ULL)) << 4);
+  }
+}
+
+static inline AES_Slice AES_Rotr32(AES_Slice x)
+{
+  return (x << 32) | (x >> 32);
+}
+
+static inline AES_Slice AES_Rotr16(AES_Slice x)
+{
+  return (x >> 16) | (x << 48);
+}
+
+static void AES_Mix_Columns(AES_Slice *q)
+{
+  AES_Slice q0, q1, q2, q3, q4, q5, q6, q7;
+  AES_Slice r0, r1, r2, r3, r4, r5, r6, r7;
+
+  q0 = q[0];
+  q1 = q[1];
+  q2 = q[2];
+  q3 = q[3];
+  q4 = q[4];
+  q5 = q[5];
+  q6 = q[6];
+  q7 = q[7];
+  r0 = AES_Rotr16(q0);
+  r1 = AES_Rotr16(q1);
+  r2 = AES_Rotr16(q2);
+  r3 = AES_Rotr16(q3);
+  r4 = AES_Rotr16(q4);
+  r5 = AES_Rotr16(q5);
+  r6 = AES_Rotr16(q6);
+  r7 = AES_Rotr16(q7);
+
+  q[0] = q7 ^ r7 ^ r0 ^ AES_Rotr32(q0 ^ r0);
+  q[1] = q0 ^ r0 ^ q7 ^ r7 ^ r1 ^ AES_Rotr32(q1 ^ r1);
+  q[2] = q1 ^ r1 ^ r2 ^ AES_Rotr32(q2 ^ r2);
+  q[3] = q2 ^ r2 ^ q7 ^ r7 ^ r3 ^ AES_Rotr32(q3 ^ r3);
+  q[4] = q3 ^ r3 ^ q7 ^ r7 ^ r4 ^ AES_Rotr32(q4 ^ r4);
+  q[5] = q4 ^ r4 ^ r5 ^ AES_Rotr32(q5 ^ r5);
+  q[6] = q5 ^ r5 ^ r6 ^ AES_Rotr32(q6 ^ r6);
+  q[7] = q6 ^ r6 ^ r7 ^ AES_Rotr32(q7 ^ r7);
+}
+
+static inline void AES_Add_Round_Key(AES_Slice *q, const AES_Slice *k)
+{
+  for (unsigned char i = 0; i < 8; i++)
+    q[i] ^= k[i];
+}
+
+// ----------------------------------------------- //
+// key schedule in slices, same key in every block
+// ----------------------------------------------- //
+
+static void AES_Slice_Key(AES_Slice *k, const unsigned char *Round_Key)
+{
+  uint32_t w[4];
+  uint64_t q0, q1;
+
+  for (unsigned char i = 0; i < 4; i++)
+    w[i] = AES_LOAD32(Round_Key + (4 * i));
+  AES_Interleave_In(&q0, &q1, w);
+
+  for (unsigned char i = 0; i < 4; i++)
+  {
+    k[i] = AES_Splat(q0);
+    k[i + 4] = AES_Splat(q1);
+  }
+  AES_Ortho(k);
+}
+
+// ----------------------------------------------- //
+// sliced schedule, kept in the AES_Context
+// ----------------------------------------------- //
+
+// Slicing the 11 round keys costs about as much as a
+// pass of 8 blocks, so AES_Expand_Key() does it once
+// per key and the sliced keys live and go with the
+// rest of the schedule.
+void AES_Bitslice_Expand_Key(AES_Context *Context)
+{
+  for (unsigned char Round = 0; Round < 11; Round++)
+    AES_Slice_Key(Context->Sliced_Key + (8 * Round), Context->Round_Key + (16 * Round));
+}
+
+// ----------------------------------------------- //
+// 8 blocks
+// ----------------------------------------------- //
+
+static void AES_Bitslice_Encrypt_8(unsigned char *Data, const AES_Slice *Key)
+{
+  AES_Slice q[8];
+  uint32_t w[4];
+  uint64_t q0, q1;
+  unsigned char Lane, i, Round;
+
+  for (Lane = 0; Lane < AES_LANES; Lane++)
+  {
+    for (i = 0; i < 4; i++)
+    {
+      const unsigned char *Block = Data + (16 * (4 * Lane + i));
+      w[0] = AES_LOAD32(Block + 0);
+      w[1] = AES_LOAD32(Block + 4);
+      w[2] = AES_LOAD32(Block + 8);
+      w[3] = AES_LOAD32(Block + 12);
+      AES_Interleave_In(&q0, &q1, w);
+      q[i][Lane] = q0;
+      q[i + 4][Lane] = q1;
+    }
+  }
+  AES_Ortho(q);
+
+  AES_Add_Round_Key(q, Key);
+  for (Round = 1; Round < 10; Round++)
+  {
+    AES_Sub_Bytes(q);
+    AES_Shift_Rows(q);
+    AES_Mix_Columns(q);
+    AES_Add_Round_Key(q, Key + (8 * Round));
+  }
+  AES_Sub_Bytes(q);
+  AES_Shift_Rows(q);
+  AES_Add_Round_Key(q, Key + 80);
+
+  AES_Ortho(q);
+  for (Lane = 0; Lane < AES_LANES; Lane++)
+  {
+    for (i = 0; i < 4; i++)
+    {
+      unsigned char *Block = Data + (16 * (4 * Lane + i));
+      AES_Interleave_Out(w, q[i][Lane], q[i + 4][Lane]);
+      AES_STORE32(Block + 0, w[0]);
+      AES_STORE32(Block + 4, w[1]);
+      AES_STORE32(Block + 8, w[2]);
+      AES_STORE32(Block + 12, w[3]);
+    }
+  }
+}
+
+void AES_Bitslice_Encrypt_Blocks(unsigned char *Data, unsigned char Blocks, AES_Context *Context)
+{
+  const AES_Slice *Key = Context->Sliced_Key;
+  unsigned char Tail[128];
+
+  while (Blocks >= 8)
+  {
+    AES_Bitslice_Encrypt_8(Data, Key);
+    Data += 128;
+    Blocks -= 8;
+  }
+
+  // a short pass still runs the full 8 block circuit
+  if (Blocks > 0)
+  {
+    memset(Tail, 0, sizeof(Tail));
+    memcpy(Tail, Data, 16 * Blocks);
+    AES_Bitslice_Encrypt_8(Tail, Key);
+    memcpy(Data, Tail, 16 * Blocks);
+  }
+}
+
+#endif // AES_USE_BITSLICE
@@ -0,0 +1,98 @@
+// ----------------------------------------------- //
+// AES-128_NI.cpp
+// ----------------------------------------------- //
+//
+// AES-128 encryption with the x86 AES-NI instructions,
+// selected with AES_USE_AESNI in AES-128_V10.h.
+//
+// AES_NI_Supported() reads CPUID once, the portable
+// AES_Encrypt() and AES_Encrypt_Blocks() call in here
+// only when it returns true.
+//
+// ----------------------------------------------- //
+
+#include <stdint.h>
+#include "AES-128_V10.h"
+
+#if defined(AES_USE_AESNI)
+
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+
+#define AES_NI_TARGET __attribute__((target("aes,sse2")))
+
+static bool AES_NI_Detect()
+{
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return false;
+  return (ecx & bit_AES) && (edx & bit_SSE2);
+}
+
+bool AES_NI_Supported()
+{
+  static const bool Supported = AES_NI_Detect();
+  return Supported;
+}
+
+AES_NI_TARGET
+static inline void AES_NI_Load_Key(__m128i *Key, AES_Context *Context)
+{
+  for (unsigned char i = 0; i < 11; i++)
+    Key[i] = _mm_loadu_si128((const __m128i *)(Context->Round_Key + (16 * i)));
+}
+
+AES_NI_TARGET
+void AES_NI_Encrypt(unsigned char *Data, AES_Context *Context)
+{
+  __m128i Key[11];
+  AES_NI_Load_Key(Key, Context);
+
+  __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)Data), Key[0]);
+  for (unsigned char Round = 1; Round < 10; Round++)
+    b = _mm_aesenc_si128(b, Key[Round]);
+  b = _mm_aesenclast_si128(b, Key[10]);
+  _mm_storeu_si128((__m128i *)Data, b);
+}
+
+// Four blocks go through each round together, so the
+// latency of one aesenc is hidden behind the others.
+AES_NI_TARGET
+void AES_NI_Encrypt_Blocks(unsigned char *Data, unsigned char Blocks, AES_Context *Context)
+{
+  __m128i Key[11];
+  AES_NI_Load_Key(Key, Context);
+
+  while (Blocks >= 4)
+  {
+    __m128i b0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(Data + 0)), Key[0]);
+    __m128i b1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(Data + 16)), Key[0]);
+    __m128i b2 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(Data + 32)), Key[0]);
+    __m128i b3 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(Data + 48)), Key[0]);
+    for (unsigned char Round = 1; Round < 10; Round++)
+    {
+      b0 = _mm_aesenc_si128(b0, Key[Round]);
+      b1 = _mm_aesenc_si128(b1, Key[Round]);
+      b2 = _mm_aesenc_si128(b2, Key[Round]);
+      b3 = _mm_aesenc_si128(b3, Key[Round]);
+    }
+    _mm_storeu_si128((__m128i *)(Data + 0), _mm_aesenclast_si128(b0, Key[10]));
+    _mm_storeu_si128((__m128i *)(Data + 16), _mm_aesenclast_si128(b1, Key[10]));
+    _mm_storeu_si128((__m128i *)(Data + 32), _mm_aesenclast_si128(b2, Key[10]));
+    _mm_storeu_si128((__m128i *)(Data + 48), _mm_aesenclast_si128(b3, Key[10]));
+    Data += 64;
+    Blocks -= 4;
+  }
+
+  while (Blocks--)
+  {
+    __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)Data), Key[0]);
+    for (unsigned char Round = 1; Round < 10; Round++)
+      b = _mm_aesenc_si128(b, Key[Round]);
+    _mm_storeu_si128((__m128i *)Data, _mm_aesenclast_si128(b, Key[10]));
+    Data += 16;
+  }
+}
+
+#endif // AES_USE_AESNI
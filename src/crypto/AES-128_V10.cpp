@@ -39,8 +39,14 @@
 //  - Tabs were converted to 2 spaces
 //  - An #include and #if guard was added
 //  - S_Table is now stored in PROGMEM
+//  - AES_Expand_Key() and a AES_Context variant of AES_Encrypt() were added
+//  - State is now a local of AES_Encrypt(), so encryption is reentrant
+//  - AES_Encrypt() is left to AES-128_TTable.cpp when AES_USE_TTABLE is set
+//  - AES_Encrypt_Blocks() was added, AES-NI or the bitsliced code is used when present
+//  - Blocks and key schedules are counted in CryptoStats with LORAWAN_STATS
 
-
+#include "AES-128_V10.h"
+#include "CryptoStats.h"
 
 /*
 ********************************************************************************************
@@ -48,10 +54,8 @@
 ********************************************************************************************
 */
 
-static unsigned char State[4][4];
-
 //static CONST_TABLE(unsigned char, S_Table)[16][16] = {
-unsigned char S_Table[16][16] = {
+static const unsigned char S_Table[16][16] = {
   {0x63,0x7C,0x77,0x7B,0xF2,0x6B,0x6F,0xC5,0x30,0x01,0x67,0x2B,0xFE,0xD7,0xAB,0x76},
   {0xCA,0x82,0xC9,0x7D,0xFA,0x59,0x47,0xF0,0xAD,0xD4,0xA2,0xAF,0x9C,0xA4,0x72,0xC0},
   {0xB7,0xFD,0x93,0x26,0x36,0x3F,0xF7,0xCC,0x34,0xA5,0xE5,0xF1,0x71,0xD8,0x31,0x15},
@@ -72,12 +76,18 @@ unsigned char S_Table[16][16] = {
 
 //extern "C" void AES_Encrypt(unsigned char *Data, unsigned char *Key);
 void AES_Encrypt(unsigned char *Data, unsigned char *Key);
-static void AES_Add_Round_Key(unsigned char *Round_Key);
+void AES_Encrypt(unsigned char *Data, AES_Context *Context);
+void AES_Expand_Key(AES_Context *Context, unsigned char *Key);
+void AES_Encrypt_Blocks(unsigned char *Data, unsigned char Blocks, AES_Context *Context);
 static unsigned char AES_Sub_Byte(unsigned char Byte);
-static void AES_Shift_Rows();
-static void AES_Mix_Collums();
 static void AES_Calculate_Round_Key(unsigned char Round, unsigned char *Round_Key);
 
+#if !defined(AES_USE_TTABLE)
+
+static void AES_Add_Round_Key(unsigned char State[][4], unsigned char *Round_Key);
+static void AES_Shift_Rows(unsigned char State[][4]);
+static void AES_Mix_Collums(unsigned char State[][4]);
+
 /*
 *****************************************************************************************
 * Description : Function for encrypting data using AES-128
@@ -92,6 +102,19 @@ void AES_Encrypt(unsigned char *Data, unsigned char *Key)
   unsigned char Row,Collum;
   unsigned char Round = 0x00;
   unsigned char Round_Key[16];
+  unsigned char State[4][4];
+
+#if defined(AES_USE_BITSLICE)
+  // the round keys below go through the S-box table, the bitsliced code
+  // takes them from a schedule
+  AES_Context Context;
+  AES_Expand_Key(&Context, Key);
+  AES_Encrypt(Data, &Context);
+  return;
+#endif
+
+  CRYPTO_COUNT(AesBlocks, 1);
+  CRYPTO_COUNT(KeyExpansions, 1);
 
   //Copy input to State arry
   for(Collum = 0; Collum < 4; Collum++)
@@ -109,7 +132,7 @@ void AES_Encrypt(unsigned char *Data, unsigned char *Key)
   }
 
   //Add round key
-  AES_Add_Round_Key(Round_Key);
+  AES_Add_Round_Key(State,Round_Key);
 
   //Preform 9 full rounds
   for(Round = 1; Round < 10; Round++)
@@ -124,16 +147,16 @@ void AES_Encrypt(unsigned char *Data, unsigned char *Key)
     }
 
     //Preform Row Shift
-    AES_Shift_Rows();
+    AES_Shift_Rows(State);
 
     //Mix Collums
-    AES_Mix_Collums();
+    AES_Mix_Collums(State);
 
     //Calculate new round key
     AES_Calculate_Round_Key(Round,Round_Key);
 
     //Add round key
-    AES_Add_Round_Key(Round_Key);
+    AES_Add_Round_Key(State,Round_Key);
   }
 
   //Last round whitout mix collums
@@ -147,13 +170,103 @@ void AES_Encrypt(unsigned char *Data, unsigned char *Key)
   }
 
   //Shift rows
-  AES_Shift_Rows();
+  AES_Shift_Rows(State);
 
   //Calculate new round key
   AES_Calculate_Round_Key(Round,Round_Key);
 
   //Add round Key
-  AES_Add_Round_Key(Round_Key);
+  AES_Add_Round_Key(State,Round_Key);
+
+  //Copy the State into the data array
+  for(Collum = 0; Collum < 4; Collum++)
+  {
+    for(Row = 0; Row < 4; Row++)
+    {
+      Data[Row + (4*Collum)] = State[Row][Collum];
+    }
+  }
+
+}
+
+/*
+*****************************************************************************************
+* Description : Function for encrypting data using a expanded AES-128 key schedule
+*
+* Arguments   : *Data     Data to encrypt is a 16 byte long arry
+*               *Context  Key schedule filled by AES_Expand_Key
+*****************************************************************************************
+*/
+void AES_Encrypt(unsigned char *Data, AES_Context *Context)
+{
+  unsigned char Row,Collum;
+  unsigned char Round = 0x00;
+  unsigned char State[4][4];
+
+  CRYPTO_COUNT(AesBlocks, 1);
+
+#if defined(AES_USE_AESNI)
+  if(AES_NI_Supported())
+  {
+    AES_NI_Encrypt(Data, Context);
+    return;
+  }
+#endif
+
+#if defined(AES_USE_BITSLICE)
+  AES_Bitslice_Encrypt_Blocks(Data, 1, Context);
+  return;
+#endif
+
+  //Copy input to State arry
+  for(Collum = 0; Collum < 4; Collum++)
+  {
+    for(Row = 0; Row < 4; Row++)
+    {
+      State[Row][Collum] = Data[Row + (4*Collum)];
+    }
+  }
+
+  //Add round key
+  AES_Add_Round_Key(State,Context->Round_Key);
+
+  //Preform 9 full rounds
+  for(Round = 1; Round < 10; Round++)
+  {
+    //Preform Byte substitution with S table
+    for(Collum = 0; Collum < 4; Collum++)
+    {
+      for(Row = 0; Row < 4; Row++)
+      {
+        State[Row][Collum] = AES_Sub_Byte(State[Row][Collum]);
+      }
+    }
+
+    //Preform Row Shift
+    AES_Shift_Rows(State);
+
+    //Mix Collums
+    AES_Mix_Collums(State);
+
+    //Add round key
+    AES_Add_Round_Key(State,Context->Round_Key + (16*Round));
+  }
+
+  //Last round whitout mix collums
+  //Preform Byte substitution with S table
+  for(Collum = 0; Collum < 4; Collum++)
+  {
+    for(Row = 0; Row < 4; Row++)
+    {
+      State[Row][Collum] = AES_Sub_Byte(State[Row][Collum]);
+    }
+  }
+
+  //Shift rows
+  AES_Shift_Rows(State);
+
+  //Add round Key
+  AES_Add_Round_Key(State,Context->Round_Key + (16*Round));
 
   //Copy the State into the data array
   for(Collum = 0; Collum < 4; Collum++)
@@ -163,17 +276,92 @@ void AES_Encrypt(unsigned char *Data, unsigned char *Key)
       Data[Row + (4*Collum)] = State[Row][Collum];
     }
   }
+}
+
+#endif // AES_USE_TTABLE
+
+/*
+*****************************************************************************************
+* Description : Function that calculates all round keys of a AES-128 key once
+*
+* Arguments   : *Context  Key schedule to fill, 11 round keys of 16 bytes
+*               *Key      Key to expand is a 16 byte long arry
+*****************************************************************************************
+*/
+void AES_Expand_Key(AES_Context *Context, unsigned char *Key)
+{
+  unsigned char i;
+  unsigned char Round;
+  unsigned char *Round_Key = Context->Round_Key;
+
+  CRYPTO_COUNT(KeyExpansions, 1);
+
+  //Copy key to first round key
+  for(i = 0; i < 16; i++)
+  {
+    Round_Key[i] = Key[i];
+  }
+
+  //Each round key is calculated from the previous one
+  for(Round = 1; Round < 11; Round++)
+  {
+    for(i = 0; i < 16; i++)
+    {
+      Round_Key[i + 16] = Round_Key[i];
+    }
+    Round_Key += 16;
+    AES_Calculate_Round_Key(Round,Round_Key);
+  }
 
+#if defined(AES_USE_BITSLICE)
+  AES_Bitslice_Expand_Key(Context);
+#endif
 }
 
+/*
+*****************************************************************************************
+* Description : Function for encrypting independent blocks with the same key, like the
+*               A blocks of CTR mode. Backends that pipeline blocks get them all at once.
+*
+* Arguments   : *Data     Blocks to encrypt, 16 bytes each one after the other
+*                Blocks   Number of blocks in Data
+*               *Context  Key schedule filled by AES_Expand_Key
+*****************************************************************************************
+*/
+void AES_Encrypt_Blocks(unsigned char *Data, unsigned char Blocks, AES_Context *Context)
+{
+#if defined(AES_USE_AESNI)
+  if(AES_NI_Supported())
+  {
+    CRYPTO_COUNT(AesBlocks, Blocks);
+    AES_NI_Encrypt_Blocks(Data, Blocks, Context);
+    return;
+  }
+#endif
+
+#if defined(AES_USE_BITSLICE)
+  CRYPTO_COUNT(AesBlocks, Blocks);
+  AES_Bitslice_Encrypt_Blocks(Data, Blocks, Context);
+#else
+  while(Blocks--)
+  {
+    AES_Encrypt(Data, Context);
+    Data += 16;
+  }
+#endif
+}
+
+#if !defined(AES_USE_TTABLE)
+
 /*
 *****************************************************************************************
 * Description : Function that add's the round key for the current round
 *
-* Arguments   : *Round_Key    16 byte long array holding the Round Key
+* Arguments   :  State        4x4 state of the block being encrypted
+*               *Round_Key    16 byte long array holding the Round Key
 *****************************************************************************************
 */
-static void AES_Add_Round_Key(unsigned char *Round_Key)
+static void AES_Add_Round_Key(unsigned char State[][4], unsigned char *Round_Key)
 {
   unsigned char Row,Collum;
 
@@ -186,6 +374,8 @@ static void AES_Add_Round_Key(unsigned char *Round_Key)
   }
 }
 
+#endif // AES_USE_TTABLE
+
 /*
 *****************************************************************************************
 * Description : Function that substitutes a byte with a byte from the S_Table
@@ -210,12 +400,16 @@ static unsigned char AES_Sub_Byte(unsigned char Byte)
   return S_Byte;
 }
 
+#if !defined(AES_USE_TTABLE)
+
 /*
 *****************************************************************************************
 * Description : Function that preforms the shift row operation described in the AES standard
+*
+* Arguments   : State   4x4 state of the block being encrypted
 *****************************************************************************************
 */
-static void AES_Shift_Rows()
+static void AES_Shift_Rows(unsigned char State[][4])
 {
   unsigned char Buffer;
 
@@ -249,9 +443,11 @@ static void AES_Shift_Rows()
 /*
 *****************************************************************************************
 * Description : Function that preforms the Mix Collums operation described in the AES standard
+*
+* Arguments   : State   4x4 state of the block being encrypted
 *****************************************************************************************
 */
-static void AES_Mix_Collums()
+static void AES_Mix_Collums(unsigned char State[][4])
 {
   unsigned char Row,Collum;
   unsigned char a[4], b[4];
@@ -274,6 +470,8 @@ static void AES_Mix_Collums()
   }
 }
 
+#endif // AES_USE_TTABLE
+
 /*
 *****************************************************************************************
 * Description : Function that calculaties the round key for the current round
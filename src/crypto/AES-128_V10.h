@@ -36,6 +36,78 @@
 #ifndef AES128_V10_H
 #define AES128_V10_H
 
+/*
+********************************************************************************************
+* BACKEND
+*
+* AES_USE_TTABLE  32-bit T-table AES_Encrypt() from AES-128_TTable.cpp, 1 kB of tables.
+*                 Default on 64-bit hosts, define AES_USE_BYTE to force the byte
+*                 oriented code below on those targets.
+*
+* AES_USE_AESNI   AES-NI instructions from AES-128_NI.cpp, used when the CPU reports
+*                 them at runtime. Default on x86 hosts built with GCC or Clang, define
+*                 AES_NO_AESNI to leave it out.
+*
+* AES_USE_BITSLICE  Constant time bitsliced AES from AES-128_Bitslice.cpp, 8 blocks per
+*                   pass. When AES-NI is not available every block goes through it, a
+*                   single one or a short pass included, so no table is indexed with the
+*                   data; only AES_Expand_Key() still uses the S-box table, once per key.
+*                   Slower than the T-table on short payloads and the CMAC, and it adds
+*                   the sliced round keys to AES_Context: define it for the whole build
+*                   on 64-bit GCC or Clang hosts that need it.
+*
+* AES_PARALLEL_BLOCKS  Number of independent blocks the CTR loops hand to
+*                      AES_Encrypt_Blocks() at once.
+********************************************************************************************
+*/
+
+#if !defined(AES_USE_BYTE) && !defined(AES_USE_TTABLE)
+#if defined(__x86_64__) || defined(_M_X64) || defined(__aarch64__)
+#define AES_USE_TTABLE
+#endif
+#endif
+
+#if !defined(AES_NO_AESNI) && !defined(AES_USE_AESNI)
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define AES_USE_AESNI
+#endif
+#endif
+
+#if !defined(AES_PARALLEL_BLOCKS)
+#if defined(AES_USE_BITSLICE)
+#define AES_PARALLEL_BLOCKS 8
+#elif defined(AES_USE_AESNI)
+#define AES_PARALLEL_BLOCKS 4
+#else
+#define AES_PARALLEL_BLOCKS 1
+#endif
+#endif
+
+/*
+********************************************************************************************
+* TYPES
+********************************************************************************************
+*/
+
+#if defined(AES_USE_BITSLICE)
+#include <stdint.h>
+
+// bit n of every byte of 8 blocks, in two 64-bit lanes
+typedef uint64_t AES_Slice __attribute__((vector_size(16)));
+#endif
+
+/*
+* Expanded AES-128 key schedule, 11 round keys of 16 bytes.
+* Fill it once with AES_Expand_Key() and reuse it for every block encrypted with that key.
+*/
+typedef struct
+{
+  unsigned char Round_Key[176];
+#if defined(AES_USE_BITSLICE)
+  AES_Slice Sliced_Key[88];   // the same round keys, 8 slices each
+#endif
+} AES_Context;
+
 /*
 ********************************************************************************************
 * FUNCTION PORTOTYPES
@@ -43,12 +115,19 @@
 */
 
 void AES_Encrypt(unsigned char *Data, unsigned char *Key);
-void AES_Add_Round_Key(unsigned char *Round_Key);
-unsigned char AES_Sub_Byte(unsigned char Byte);
-void AES_Shift_Rows();
-void AES_Mix_Collums();
-void AES_Calculate_Round_Key(unsigned char Round, unsigned char *Round_Key);
+void AES_Encrypt(unsigned char *Data, AES_Context *Context);
+void AES_Expand_Key(AES_Context *Context, unsigned char *Key);
+void AES_Encrypt_Blocks(unsigned char *Data, unsigned char Blocks, AES_Context *Context);
+
+#if defined(AES_USE_AESNI)
+bool AES_NI_Supported();
+void AES_NI_Encrypt(unsigned char *Data, AES_Context *Context);
+void AES_NI_Encrypt_Blocks(unsigned char *Data, unsigned char Blocks, AES_Context *Context);
+#endif
+
+#if defined(AES_USE_BITSLICE)
+void AES_Bitslice_Expand_Key(AES_Context *Context);
+void AES_Bitslice_Encrypt_Blocks(unsigned char *Data, unsigned char Blocks, AES_Context *Context);
+#endif
 
-#else
-#error "AES128_V10_H not defined"
 #endif
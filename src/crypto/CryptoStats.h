@@ -0,0 +1,72 @@
+// ----------------------------------------------- //
+// CryptoStats.h
+// ----------------------------------------------- //
+//
+// Call counters and timings of the crypto layer,
+// compiled only with LORAWAN_STATS defined
+//
+// ----------------------------------------------- //
+
+#ifndef __CRYPTO_STATS_H__
+#define __CRYPTO_STATS_H__
+
+#include <stdint.h>
+
+// The crypto files are built on their own, so define it here or as a build flag
+//#define LORAWAN_STATS
+
+typedef struct
+{
+  uint32_t Count;
+  uint64_t Total;   // LORAWAN_STATS_CLOCK ticks
+  uint32_t Max;
+} Crypto_Timing;
+
+#ifdef LORAWAN_STATS
+
+// Timer used for the timings: CPU cycles on x86, micros() elsewhere
+#ifndef LORAWAN_STATS_CLOCK
+#if defined(__x86_64__) || defined(__i386__)
+#define LORAWAN_STATS_CLOCK() ((uint32_t)__builtin_ia32_rdtsc())
+#else
+#define LORAWAN_STATS_CLOCK() ((uint32_t)micros())
+#endif
+#endif
+
+typedef struct
+{
+  uint32_t AesBlocks;       // AES-128 block encryptions, any backend
+  uint32_t KeyExpansions;   // AES key schedules computed
+  uint32_t Subkeys;         // CMAC K1/K2 pairs generated
+  uint32_t CmacCalls;       // CMACs computed, one per checked frame counter
+  uint32_t BytesEncrypted;  // CTR payload bytes
+
+  Crypto_Timing Keys;       // session and join key setup
+  Crypto_Timing Mic;        // MIC computed or checked
+  Crypto_Timing Ctr;        // payload encryption
+} Crypto_Stats;
+
+extern Crypto_Stats CryptoStats;
+
+void Crypto_Time(Crypto_Timing *timing, uint32_t ticks);
+
+// Counters stay exact with decodeBatch() threads on a host, Max may miss a race
+#if defined(__GNUC__) && !defined(ARDUINO)
+#define CRYPTO_STAT_ADD(field, n) __atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED)
+#else
+#define CRYPTO_STAT_ADD(field, n) ((field) += (n))
+#endif
+
+#define CRYPTO_COUNT(field, n) CRYPTO_STAT_ADD(CryptoStats.field, (n))
+#define CRYPTO_TIME_START(t) uint32_t t = LORAWAN_STATS_CLOCK()
+#define CRYPTO_TIME_STOP(timing, t) Crypto_Time(&(timing), LORAWAN_STATS_CLOCK() - (t))
+
+#else
+
+#define CRYPTO_COUNT(field, n) do {} while (0)
+#define CRYPTO_TIME_START(t) do {} while (0)
+#define CRYPTO_TIME_STOP(timing, t) do {} while (0)
+
+#endif
+
+#endif // __CRYPTO_STATS_H__
@@ -27,92 +27,39 @@
 
 #include "AES-128_V10.h"
 #include "LoRaMacCrypto.h"
+#include "CryptoStats.h"
 
+#ifdef LORAWAN_STATS
+Crypto_Stats CryptoStats;
 
-void LoRaMacJoinComputeMic( uint8_t *data, uint8_t len, uint8_t *key, uint32_t *mic )
+void Crypto_Time(Crypto_Timing *timing, uint32_t ticks)
 {
-  uint8_t X[16];
-  uint8_t Y[16];
-
-  // ------------------------------------
-  // Step 1: Generate the subkeys
-  //
-  uint8_t k1[16];
-  uint8_t k2[16];
-  generate_subkey(key, k1, k2);
-
-  // ------------------------------------
-  // Copy the data to a new buffer which is prepended with Block B0
-  //
-  uint8_t micBuf[len + 1]; // data
-  for (uint8_t i = 0; i < len; i++)
-    micBuf[i] = data[i];
-
-  // ------------------------------------
-  // Step 2: Calculate the number of blocks for CMAC
-  //
-  uint8_t numBlocks = len / 16; // Compensate for B0 block
-  if ((len % 16) != 0)
-    numBlocks++; // If we have only a part block, take it all
+  CRYPTO_STAT_ADD(timing->Count, 1);
+  CRYPTO_STAT_ADD(timing->Total, ticks);
+  if (ticks > timing->Max)
+    timing->Max = ticks;
+}
+#endif
 
-  // ------------------------------------
-  // Step 3: Calculate padding is necessary
-  //
-  uint8_t restBits = len % 16; // if numBlocks is not a multiple of 16 bytes
 
-  // ------------------------------------
-  // Step 5: Make a buffer of zeros
-  //
-  memset(X, 0, 16);
-
-  // ------------------------------------
-  // Step 6: Do the actual encoding according to RFC
-  //
-  for (uint8_t i = 0x0; i < (numBlocks - 1); i++)
-  {
-    for (uint8_t j = 0; j < 16; j++)
-      Y[j] = micBuf[(i * 16) + j];
-    mXor(Y, X);
-    AES_Encrypt(Y, key);
-    for (uint8_t j = 0; j < 16; j++)
-      X[j] = Y[j];
-  }
+void LoRaMacJoinComputeMic( uint8_t *data, uint16_t len, CMAC_Key *cmac, uint32_t *mic )
+{
+  CMAC_Context ctx;
+  uint8_t Y[16];
 
   // ------------------------------------
-  // Step 4: If there is a rest Block, padd it
-  // Last block. We move step4 to the end as we need Y
-  // to compute the last block
+  // CMAC straight over the data
   //
-  if (restBits)
-  {
-    for (uint8_t i = 0; i < 16; i++)
-    {
-      if (i < restBits)
-        Y[i] = micBuf[((numBlocks - 1) * 16) + i];
-      if (i == restBits)
-        Y[i] = 0x80;
-      if (i > restBits)
-        Y[i] = 0x00;
-    }
-    mXor(Y, k2);
-  }
-  else
-  {
-    for (uint8_t i = 0; i < 16; i++)
-    {
-      Y[i] = micBuf[((numBlocks - 1) * 16) + i];
-    }
-    mXor(Y, k1);
-  }
-  mXor(Y, X);
-  AES_Encrypt(Y, key);
+  CRYPTO_TIME_START(t);
+  CMAC_Init(&ctx, cmac);
+  CMAC_Update(&ctx, data, len);
+  CMAC_Final(&ctx, Y);
+  CRYPTO_TIME_STOP(CryptoStats.Mic, t);
 
   // ------------------------------------
-  // Step 7: done, return the MIC size.
   // Only 4 bytes are returned (32 bits), which is less than the RFC recommends.
   // We return by appending 4 bytes to data, so there must be space in data array.
   //
-
   data[len + 0] = Y[0];
   data[len + 1] = Y[1];
   data[len + 2] = Y[2];
@@ -121,41 +68,75 @@ void LoRaMacJoinComputeMic( uint8_t *data, uint8_t len, uint8_t *key, uint32_t *
   *mic = ( uint32_t )( ( uint32_t )Y[3] << 24 | ( uint32_t )Y[2] << 16 | ( uint32_t )Y[1] << 8 | ( uint32_t )Y[0] );
 }
 
+void LoRaMacJoinComputeMic( uint8_t *data, uint16_t len, AES_Context *aes, uint32_t *mic )
+{
+  CMAC_Key cmac;
+  generate_cmac_key(&cmac, aes);
+  LoRaMacJoinComputeMic(data, len, &cmac, mic);
+}
+
+void LoRaMacJoinComputeMic( uint8_t *data, uint16_t len, uint8_t *key, uint32_t *mic )
+{
+  CMAC_Key cmac;
+  generate_cmac_key(&cmac, key);
+  LoRaMacJoinComputeMic(data, len, &cmac, mic);
+}
+
 
-void LoRaMacJoinDecrypt( uint8_t *data, uint8_t len, uint8_t *key)
+void LoRaMacJoinDecrypt( uint8_t *data, uint16_t len, AES_Context *aes)
 {
-  AES_Encrypt(data, key);
+  AES_Encrypt(data, aes);
   if (len >= 16)
   {
-    AES_Encrypt(data + 16, key);
+    AES_Encrypt(data + 16, aes);
   }
 }
 
-void LoRaMacJoinDecrypt( const uint8_t *data, uint8_t len, const uint8_t *key, uint8_t *decBuffer ){
+void LoRaMacJoinDecrypt( uint8_t *data, uint16_t len, uint8_t *key)
+{
+  AES_Context aes;
+  AES_Expand_Key(&aes, key);
+  LoRaMacJoinDecrypt(data, len, &aes);
+}
+
+void LoRaMacJoinDecrypt( const uint8_t *data, uint16_t len, AES_Context *aes, uint8_t *decBuffer ){
   memcpy(decBuffer, data, len);
   // LoRaMacJoinDecrypt( decBuffer, len, key);
-  AES_Encrypt(decBuffer, (uint8_t *) key);
+  AES_Encrypt(decBuffer, aes);
   if (len >= 16)
   {
-    AES_Encrypt(decBuffer + 16, (uint8_t *) key);
+    AES_Encrypt(decBuffer + 16, aes);
   }
 }
 
+void LoRaMacJoinDecrypt( const uint8_t *data, uint16_t len, const uint8_t *key, uint8_t *decBuffer ){
+  AES_Context aes;
+  AES_Expand_Key(&aes, (uint8_t *) key);
+  LoRaMacJoinDecrypt(data, len, &aes, decBuffer);
+}
 
-void LoRaMacJoinComputeSKeys(uint8_t *key, uint8_t *appNonce, uint16_t devNonce, uint8_t *nwkSKey, uint8_t *appSKey)
+
+void LoRaMacJoinComputeSKeys(AES_Context *aes, uint8_t *appNonce, uint16_t devNonce, uint8_t *nwkSKey, uint8_t *appSKey)
 {
   uint8_t *pDevNonce = (uint8_t *)&devNonce;
   memset(nwkSKey, 0, 16);
   nwkSKey[0] = 0x01;
   memcpy(nwkSKey + 1, appNonce, 6);
   memcpy(nwkSKey + 7, pDevNonce, 2);
-  AES_Encrypt(nwkSKey, key);
+  AES_Encrypt(nwkSKey, aes);
 
   memset(appSKey, 0, 16);
   appSKey[0] = 0x02;
   memcpy(appSKey + 1, appNonce, 6);
   memcpy(appSKey + 7, pDevNonce, 2);
-  AES_Encrypt(appSKey, key);
+  AES_Encrypt(appSKey, aes);
+}
+
+void LoRaMacJoinComputeSKeys(uint8_t *key, uint8_t *appNonce, uint16_t devNonce, uint8_t *nwkSKey, uint8_t *appSKey)
+{
+  AES_Context aes;
+  AES_Expand_Key(&aes, key);
+  LoRaMacJoinComputeSKeys(&aes, appNonce, devNonce, nwkSKey, appSKey);
 }
 
 // ----------------------------------------------------------------------------
@@ -181,11 +162,11 @@ void LoRaMacJoinComputeSKeys(uint8_t *key, uint8_t *appNonce, uint16_t devNonce,
 //
 // ----------------------------------------------------------------------------
 
-void LoRaMacComputeMic(  uint8_t *data, uint8_t len, uint8_t *key, uint32_t address, uint8_t dir, uint32_t count, uint32_t *mic )
+void LoRaMacComputeMic(  uint8_t *data, uint16_t len, CMAC_Key *cmac, uint32_t address, uint8_t dir, uint32_t count, uint32_t *mic )
 {
   uint8_t Block_B[16];
-  uint8_t X[16];
   uint8_t Y[16];
+  CMAC_Context ctx;
 
   // ------------------------------------
   // build the B block used by the MIC process
@@ -213,82 +194,16 @@ void LoRaMacComputeMic(  uint8_t *data, uint8_t len, uint8_t *key, uint32_t addr
   Block_B[15] = len; // 1 byte len
 
   // ------------------------------------
-  // Step 1: Generate the subkeys
+  // CMAC of B0 | data, the data is not copied
   //
-  uint8_t k1[16];
-  uint8_t k2[16];
-  generate_subkey(key, k1, k2);
-
-  // ------------------------------------
-  // Copy the data to a new buffer which is prepended with Block B0
-  //
-  uint8_t micBuf[len + 16]; // B0 | data
-  for (uint8_t i = 0; i < 16; i++)
-    micBuf[i] = Block_B[i];
-  for (uint8_t i = 0; i < len; i++)
-    micBuf[i + 16] = data[i];
-
-  // ------------------------------------
-  // Step 2: Calculate the number of blocks for CMAC
-  //
-  uint8_t numBlocks = len / 16 + 1; // Compensate for B0 block
-  if ((len % 16) != 0)
-    numBlocks++; // If we have only a part block, take it all
-
-  // ------------------------------------
-  // Step 3: Calculate padding is necessary
-  //
-  uint8_t restBits = len % 16; // if numBlocks is not a multiple of 16 bytes
-
-  // ------------------------------------
-  // Step 5: Make a buffer of zeros
-  //
-  memset(X, 0, 16);
-
-  // ------------------------------------
-  // Step 6: Do the actual encoding according to RFC
-  //
-  for (uint8_t i = 0x0; i < (numBlocks - 1); i++)
-  {
-    for (uint8_t j = 0; j < 16; j++)
-      Y[j] = micBuf[(i * 16) + j];
-    mXor(Y, X);
-    AES_Encrypt(Y, key);
-    for (uint8_t j = 0; j < 16; j++)
-      X[j] = Y[j];
-  }
-
-  // ------------------------------------
-  // Step 4: If there is a rest Block, padd it
-  // Last block. We move step4 to the end as we need Y
-  // to compute the last block
-  //
-  if (restBits)
-  {
-    for (uint8_t i = 0; i < 16; i++)
-    {
-      if (i < restBits)
-        Y[i] = micBuf[((numBlocks - 1) * 16) + i];
-      if (i == restBits)
-        Y[i] = 0x80;
-      if (i > restBits)
-        Y[i] = 0x00;
-    }
-    mXor(Y, k2);
-  }
-  else
-  {
-    for (uint8_t i = 0; i < 16; i++)
-    {
-      Y[i] = micBuf[((numBlocks - 1) * 16) + i];
-    }
-    mXor(Y, k1);
-  }
-  mXor(Y, X);
-  AES_Encrypt(Y, key);
+  CRYPTO_TIME_START(t);
+  CMAC_Init(&ctx, cmac);
+  CMAC_Update(&ctx, Block_B, 16);
+  CMAC_Update(&ctx, data, len);
+  CMAC_Final(&ctx, Y);
+  CRYPTO_TIME_STOP(CryptoStats.Mic, t);
 
   // ------------------------------------
-  // Step 7: done, return the MIC size.
   // Only 4 bytes are returned (32 bits), which is less than the RFC recommends.
   // We return by appending 4 bytes to data, so there must be space in data array.
   //
@@ -300,6 +215,20 @@ void LoRaMacComputeMic(  uint8_t *data, uint8_t len, uint8_t *key, uint32_t addr
   *mic = ( uint32_t )( ( uint32_t )Y[3] << 24 | ( uint32_t )Y[2] << 16 | ( uint32_t )Y[1] << 8 | ( uint32_t )Y[0] );
 }
 
+void LoRaMacComputeMic(  uint8_t *data, uint16_t len, AES_Context *aes, uint32_t address, uint8_t dir, uint32_t count, uint32_t *mic )
+{
+  CMAC_Key cmac;
+  generate_cmac_key(&cmac, aes);
+  LoRaMacComputeMic(data, len, &cmac, address, dir, count, mic);
+}
+
+void LoRaMacComputeMic(  uint8_t *data, uint16_t len, uint8_t *key, uint32_t address, uint8_t dir, uint32_t count, uint32_t *mic )
+{
+  CMAC_Key cmac;
+  generate_cmac_key(&cmac, key);
+  LoRaMacComputeMic(data, len, &cmac, address, dir, count, mic);
+}
+
 // ----------------------------------------------------------------------------
 // LoRaMacPayloadEncrypt
 //
@@ -327,48 +256,61 @@ void LoRaMacComputeMic(  uint8_t *data, uint8_t len, uint8_t *key, uint32_t addr
 // cmac = aes128_encrypt(K, Block_A[i])
 // ----------------------------------------------------------------------------
 
-void LoRaMacPayloadEncrypt( uint8_t *data, uint8_t len, uint8_t *key, uint32_t address, uint8_t dir, uint32_t count ){
-  uint8_t i, j;
-  uint8_t Block_B[16];
-  uint8_t bLen = 16; // Block length is 16 except for last block in message
-
-  uint8_t restLength = len % 16; // We work in blocks of 16 bytes, this is the rest
-  uint8_t numBlocks = len / 16;  // Number of whole blocks to encrypt
-
-  if (restLength > 0)
+void LoRaMacPayloadEncrypt( uint8_t *data, uint16_t len, AES_Context *aes, uint32_t address, uint8_t dir, uint32_t count ){
+  CRYPTO_TIME_START(t);
+  CRYPTO_COUNT(BytesEncrypted, len);
+  uint16_t i, j, n;
+  uint8_t Block_B[16 * AES_PARALLEL_BLOCKS]; // Blocks encrypted in the same pass
+  uint8_t *Block;
+  uint16_t bLen; // Bytes of the message covered by this pass
+  uint16_t restLength = len;
+
+  uint16_t numBlocks = len / 16;  // Number of whole blocks to encrypt
+  if ((len % 16) > 0)
     numBlocks++; // And add block for the rest if any
 
-  for (i = 1; i <= numBlocks; i++)
+  for (i = 1; i <= numBlocks; i += n)
   {
-    Block_B[0] = 0x01;
+    n = numBlocks - i + 1;
+    if (n > AES_PARALLEL_BLOCKS)
+      n = AES_PARALLEL_BLOCKS;
 
-    Block_B[1] = 0x00;
-    Block_B[2] = 0x00;
-    Block_B[3] = 0x00;
-    Block_B[4] = 0x00;
+    for (j = 0; j < n; j++)
+    {
+      Block = Block_B + (16 * j);
 
-    Block_B[5] = dir; // 0 is uplink
+      Block[0] = 0x01;
 
-    Block_B[6] = ( address ) & 0xFF;
-    Block_B[7] = ( address >> 8 ) & 0xFF;
-    Block_B[8] = ( address >> 16 ) & 0xFF;
-    Block_B[9] = ( address >> 24 ) & 0xFF;
+      Block[1] = 0x00;
+      Block[2] = 0x00;
+      Block[3] = 0x00;
+      Block[4] = 0x00;
 
-    Block_B[10] = ( count ) & 0xFF;
-    Block_B[11] = ( count >> 8 ) & 0xFF;
-    Block_B[12] = ( count >> 16 ) & 0xFF;
-    Block_B[13] = ( count >> 24 ) & 0xFF;
+      Block[5] = dir; // 0 is uplink
 
-    Block_B[14] = 0x00;
+      Block[6] = ( address ) & 0xFF;
+      Block[7] = ( address >> 8 ) & 0xFF;
+      Block[8] = ( address >> 16 ) & 0xFF;
+      Block[9] = ( address >> 24 ) & 0xFF;
 
-    Block_B[15] = i;
+      Block[10] = ( count ) & 0xFF; // 4 byte FCNT
+      Block[11] = ( count >> 8 ) & 0xFF;
+      Block[12] = ( count >> 16 ) & 0xFF;
+      Block[13] = ( count >> 24 ) & 0xFF;
 
-    // Encrypt and calculate the S
-    AES_Encrypt(Block_B, key);
+      Block[14] = 0x00;
+
+      Block[15] = i + j;
+    }
 
-    // Last block? set bLen to rest
-    if ((i == numBlocks) && (restLength > 0))
+    // Encrypt and calculate the S of every block of the pass
+    AES_Encrypt_Blocks(Block_B, n, aes);
+
+    // Last pass? set bLen to rest
+    bLen = 16 * n;
+    if (bLen > restLength)
       bLen = restLength;
+    restLength -= bLen;
 
     for (j = 0; j < bLen; j++)
     {
@@ -376,25 +318,44 @@ void LoRaMacPayloadEncrypt( uint8_t *data, uint8_t len, uint8_t *key, uint32_t a
       data++;
     }
   }
+  CRYPTO_TIME_STOP(CryptoStats.Ctr, t);
+}
+
+void LoRaMacPayloadEncrypt( uint8_t *data, uint16_t len, uint8_t *key, uint32_t address, uint8_t dir, uint32_t count ){
+  AES_Context aes;
+  AES_Expand_Key(&aes, key);
+  LoRaMacPayloadEncrypt(data, len, &aes, address, dir, count);
 }
 
-void LoRaMacPayloadEncrypt( uint8_t *data, uint8_t len, uint8_t *key, uint32_t address, uint8_t dir, uint32_t count, uint8_t *decBuffer ){
+void LoRaMacPayloadEncrypt( uint8_t *data, uint16_t len, uint8_t *key, uint32_t address, uint8_t dir, uint32_t count, uint8_t *decBuffer ){
   memcpy(decBuffer, data, len);
   LoRaMacPayloadEncrypt( decBuffer, len, key, address, dir, count);
 }
 
-void LoRaMacPayloadDecrypt( uint8_t *data, uint8_t len, uint8_t *key, uint32_t address, uint8_t dir, uint32_t count )
+void LoRaMacPayloadDecrypt( uint8_t *data, uint16_t len, uint8_t *key, uint32_t address, uint8_t dir, uint32_t count )
 {
     LoRaMacPayloadEncrypt( data, len, key, address, dir, count);
 }
 
-void LoRaMacPayloadDecrypt( uint8_t *data, uint8_t len, uint8_t *key, uint32_t address, uint8_t dir, uint32_t count, uint8_t *decBuffer ){
+void LoRaMacPayloadDecrypt( uint8_t *data, uint16_t len, uint8_t *key, uint32_t address, uint8_t dir, uint32_t count, uint8_t *decBuffer ){
   memcpy(decBuffer, data, len);
   LoRaMacPayloadEncrypt( decBuffer, len, key, address, dir, count);
 }
 
+void LoRaMacPayloadEncrypt( uint8_t *data, uint16_t len, AES_Context *aes, uint32_t address, uint8_t dir, uint32_t count, uint8_t *decBuffer ){
+  memcpy(decBuffer, data, len);
+  LoRaMacPayloadEncrypt( decBuffer, len, aes, address, dir, count);
+}
 
+void LoRaMacPayloadDecrypt( uint8_t *data, uint16_t len, AES_Context *aes, uint32_t address, uint8_t dir, uint32_t count )
+{
+    LoRaMacPayloadEncrypt( data, len, aes, address, dir, count);
+}
 
+void LoRaMacPayloadDecrypt( uint8_t *data, uint16_t len, AES_Context *aes, uint32_t address, uint8_t dir, uint32_t count, uint8_t *decBuffer ){
+  memcpy(decBuffer, data, len);
+  LoRaMacPayloadEncrypt( decBuffer, len, aes, address, dir, count);
+}
 
 
 
@@ -409,97 +370,29 @@ void LoRaMacPayloadDecrypt( uint8_t *data, uint8_t len, uint8_t *key, uint32_t a
 
 
 
-uint8_t JoinComputeMic(uint8_t *data, uint8_t len, uint8_t *key)
-{
-
-  uint8_t X[16];
-  uint8_t Y[16];
 
-  // ------------------------------------
-  // Step 1: Generate the subkeys
-  //
-  uint8_t k1[16];
-  uint8_t k2[16];
-  generate_subkey(key, k1, k2);
 
-  // ------------------------------------
-  // Copy the data to a new buffer which is prepended with Block B0
-  //
-  uint8_t micBuf[len + 1]; // data
-  for (uint8_t i = 0; i < len; i++)
-    micBuf[i] = data[i];
-
-  // ------------------------------------
-  // Step 2: Calculate the number of blocks for CMAC
-  //
-  uint8_t numBlocks = len / 16; // Compensate for B0 block
-  if ((len % 16) != 0)
-    numBlocks++; // If we have only a part block, take it all
 
-  // ------------------------------------
-  // Step 3: Calculate padding is necessary
-  //
-  uint8_t restBits = len % 16; // if numBlocks is not a multiple of 16 bytes
-
-  // ------------------------------------
-  // Step 5: Make a buffer of zeros
-  //
-  memset(X, 0, 16);
+uint8_t JoinComputeMic(uint8_t *data, uint16_t len, CMAC_Key *cmac)
+{
+  CMAC_Context ctx;
+  uint8_t Y[16];
 
   // ------------------------------------
-  // Step 6: Do the actual encoding according to RFC
+  // CMAC straight over the data
   //
-  for (uint8_t i = 0x0; i < (numBlocks - 1); i++)
-  {
-    for (uint8_t j = 0; j < 16; j++)
-      Y[j] = micBuf[(i * 16) + j];
-    mXor(Y, X);
-    AES_Encrypt(Y, key);
-    for (uint8_t j = 0; j < 16; j++)
-      X[j] = Y[j];
-  }
+  CRYPTO_TIME_START(t);
+  CMAC_Init(&ctx, cmac);
+  CMAC_Update(&ctx, data, len);
+  CMAC_Final(&ctx, Y);
+  CRYPTO_TIME_STOP(CryptoStats.Mic, t);
 
   // ------------------------------------
-  // Step 4: If there is a rest Block, padd it
-  // Last block. We move step4 to the end as we need Y
-  // to compute the last block
-  //
-  if (restBits)
-  {
-    for (uint8_t i = 0; i < 16; i++)
-    {
-      if (i < restBits)
-        Y[i] = micBuf[((numBlocks - 1) * 16) + i];
-      if (i == restBits)
-        Y[i] = 0x80;
-      if (i > restBits)
-        Y[i] = 0x00;
-    }
-    mXor(Y, k2);
-  }
-  else
-  {
-    for (uint8_t i = 0; i < 16; i++)
-    {
-      Y[i] = micBuf[((numBlocks - 1) * 16) + i];
-    }
-    mXor(Y, k1);
-  }
-  mXor(Y, X);
-  AES_Encrypt(Y, key);
-
-  // ------------------------------------
-  // Step 7: done, return the MIC size.
   // Only 4 bytes are returned (32 bits), which is less than the RFC recommends.
   // We return by appending 4 bytes to data, so there must be space in data array.
   //
 
-  int ret = 0;
-  if (data[len + 0] == Y[0])
-    if (data[len + 1] == Y[1])
-      if (data[len + 2] == Y[2])
-        if (data[len + 3] == Y[3])
-          ret = 4;
+  int ret = MicEqual(data + len, Y) ? 4 : 0;
 
   data[len + 0] = Y[0];
   data[len + 1] = Y[1];
@@ -508,16 +401,56 @@ uint8_t JoinComputeMic(uint8_t *data, uint8_t len, uint8_t *key)
   return ret;
 }
 
-void JoinDecrypt(uint8_t *data, uint8_t len, uint8_t *key)
+uint8_t JoinComputeMic(uint8_t *data, uint16_t len, AES_Context *aes)
 {
-  AES_Encrypt(data, key);
+  CMAC_Key cmac;
+  generate_cmac_key(&cmac, aes);
+  return JoinComputeMic(data, len, &cmac);
+}
+
+uint8_t JoinComputeMic(uint8_t *data, uint16_t len, uint8_t *key)
+{
+  CMAC_Key cmac;
+  generate_cmac_key(&cmac, key);
+  return JoinComputeMic(data, len, &cmac);
+}
+
+// ----------------------------------------------------------------------------
+// JoinCheckMic
+// Checks the MIC at data + len against the CMAC of the len bytes before it.
+// Nothing is written, the received MIC stays in data.
+// ----------------------------------------------------------------------------
+bool JoinCheckMic(const uint8_t *data, uint16_t len, CMAC_Key *cmac)
+{
+  CMAC_Context ctx;
+  uint8_t Y[16];
+
+  CRYPTO_TIME_START(t);
+  CMAC_Init(&ctx, cmac);
+  CMAC_Update(&ctx, data, len);
+  CMAC_Final(&ctx, Y);
+  CRYPTO_TIME_STOP(CryptoStats.Mic, t);
+
+  return MicEqual(data + len, Y);
+}
+
+void JoinDecrypt(uint8_t *data, uint16_t len, AES_Context *aes)
+{
+  AES_Encrypt(data, aes);
   if (len >= 16)
   {
-    AES_Encrypt(data + 16, key);
+    AES_Encrypt(data + 16, aes);
   }
 }
 
-void JoinComputeSKeys(uint8_t *key, uint8_t *appNonce, uint16_t devNonce, uint8_t *nwkSKey, uint8_t *appSKey)
+void JoinDecrypt(uint8_t *data, uint16_t len, uint8_t *key)
+{
+  AES_Context aes;
+  AES_Expand_Key(&aes, key);
+  JoinDecrypt(data, len, &aes);
+}
+
+void JoinComputeSKeys(AES_Context *aes, uint8_t *appNonce, uint16_t devNonce, uint8_t *nwkSKey, uint8_t *appSKey)
 {
   uint8_t *pDevNonce = (uint8_t *)&devNonce;
 
@@ -525,13 +458,20 @@ void JoinComputeSKeys(uint8_t *key, uint8_t *appNonce, uint16_t devNonce, uint8_
   nwkSKey[0] = 0x01;
   memcpy(nwkSKey + 1, appNonce, 6);
   memcpy(nwkSKey + 7, pDevNonce, 2);
-  AES_Encrypt(nwkSKey, key);
+  AES_Encrypt(nwkSKey, aes);
 
   memset(appSKey, 0, 16);
   appSKey[0] = 0x02;
   memcpy(appSKey + 1, appNonce, 6);
   memcpy(appSKey + 7, pDevNonce, 2);
-  AES_Encrypt(appSKey, key);
+  AES_Encrypt(appSKey, aes);
+}
+
+void JoinComputeSKeys(uint8_t *key, uint8_t *appNonce, uint16_t devNonce, uint8_t *nwkSKey, uint8_t *appSKey)
+{
+  AES_Context aes;
+  AES_Expand_Key(&aes, key);
+  JoinComputeSKeys(&aes, appNonce, devNonce, nwkSKey, appSKey);
 }
 
 
@@ -558,49 +498,62 @@ void JoinComputeSKeys(uint8_t *key, uint8_t *appNonce, uint16_t devNonce, uint8_
 //
 // cmac = aes128_encrypt(K, Block_A[i])
 // ----------------------------------------------------------------------------
-uint8_t PayloadEncode(uint8_t *buf, uint8_t len, uint8_t *key, uint8_t *dev, uint32_t count, uint8_t dir)
+uint16_t PayloadEncode(uint8_t *buf, uint16_t len, AES_Context *aes, uint8_t *dev, uint32_t count, uint8_t dir)
 {
-
-  uint8_t i, j;
-  uint8_t Block_A[16];
-  uint8_t bLen = 16; // Block length is 16 except for last block in message
-
-  uint8_t restLength = len % 16; // We work in blocks of 16 bytes, this is the rest
-  uint8_t numBlocks = len / 16;  // Number of whole blocks to encrypt
-  if (restLength > 0)
+  CRYPTO_TIME_START(t);
+  CRYPTO_COUNT(BytesEncrypted, len);
+  uint16_t i, j, n;
+  uint8_t Block_A[16 * AES_PARALLEL_BLOCKS]; // Blocks encrypted in the same pass
+  uint8_t *Block;
+  uint16_t bLen; // Bytes of the message covered by this pass
+  uint16_t restLength = len;
+
+  uint16_t numBlocks = len / 16;  // Number of whole blocks to encrypt
+  if ((len % 16) > 0)
     numBlocks++; // And add block for the rest if any
 
-  for (i = 1; i <= numBlocks; i++)
+  for (i = 1; i <= numBlocks; i += n)
   {
-    Block_A[0] = 0x01;
+    n = numBlocks - i + 1;
+    if (n > AES_PARALLEL_BLOCKS)
+      n = AES_PARALLEL_BLOCKS;
+
+    for (j = 0; j < n; j++)
+    {
+      Block = Block_A + (16 * j);
+
+      Block[0] = 0x01;
 
-    Block_A[1] = 0x00;
-    Block_A[2] = 0x00;
-    Block_A[3] = 0x00;
-    Block_A[4] = 0x00;
+      Block[1] = 0x00;
+      Block[2] = 0x00;
+      Block[3] = 0x00;
+      Block[4] = 0x00;
 
-    Block_A[5] = dir; // 0 is uplink
+      Block[5] = dir; // 0 is uplink
 
-    Block_A[6] = dev[3]; // Only works for and with ABP
-    Block_A[7] = dev[2];
-    Block_A[8] = dev[1];
-    Block_A[9] = dev[0];
+      Block[6] = dev[3]; // Only works for and with ABP
+      Block[7] = dev[2];
+      Block[8] = dev[1];
+      Block[9] = dev[0];
 
-    Block_A[10] = (count & 0xFF); // 4 byte FCNT
-    Block_A[11] = ((count >> 8) & 0xFF);
-    Block_A[12] = ((count >> 16) & 0xFF);
-    Block_A[13] = ((count >> 24) & 0xFF);
+      Block[10] = ( count ) & 0xFF; // 4 byte FCNT
+      Block[11] = ( count >> 8 ) & 0xFF;
+      Block[12] = ( count >> 16 ) & 0xFF;
+      Block[13] = ( count >> 24 ) & 0xFF;
 
-    Block_A[14] = 0x00;
+      Block[14] = 0x00;
 
-    Block_A[15] = i;
+      Block[15] = i + j;
+    }
 
-    // Encrypt and calculate the S
-    AES_Encrypt(Block_A, key);
+    // Encrypt and calculate the S of every block of the pass
+    AES_Encrypt_Blocks(Block_A, n, aes);
 
-    // Last block? set bLen to rest
-    if ((i == numBlocks) && (restLength > 0))
+    // Last pass? set bLen to rest
+    bLen = 16 * n;
+    if (bLen > restLength)
       bLen = restLength;
+    restLength -= bLen;
 
     for (j = 0; j < bLen; j++)
     {
@@ -608,10 +561,174 @@ uint8_t PayloadEncode(uint8_t *buf, uint8_t len, uint8_t *key, uint8_t *dev, uin
       buf++;
     }
   }
+  CRYPTO_TIME_STOP(CryptoStats.Ctr, t);
   //return(numBlocks*16);     // Do we really want to return all 16 bytes in lastblock
   return (len); // or only 16*(numBlocks-1)+bLen;
 }
 
+uint16_t PayloadEncode(uint8_t *buf, uint16_t len, uint8_t *key, uint8_t *dev, uint32_t count, uint8_t dir)
+{
+  AES_Context aes;
+  AES_Expand_Key(&aes, key);
+  return PayloadEncode(buf, len, &aes, dev, count, dir);
+}
+
+// ----------------------------------------------------------------------------
+// PayloadEncode() of fragments
+// Encrypts the fragments into out, the same as PayloadEncode() of their bytes
+// written one after the other. Each byte is read once from its fragment and
+// XORed straight into out, there is no copy of the whole payload first.
+// A fragment may be out itself, for a payload encrypted in place.
+// With ctx, every pass of ciphertext also goes into the CMAC while it is
+// still in cache, instead of a second pass over the frame for the MIC.
+// ----------------------------------------------------------------------------
+static void PayloadCtr(uint8_t *out, const Payload_Fragment *fragments, uint16_t len, AES_Context *aes, uint8_t *dev, uint32_t count, uint8_t dir, CMAC_Context *ctx)
+{
+  uint8_t Block_A[16 * AES_PARALLEL_BLOCKS]; // Blocks encrypted in the same pass
+  uint8_t *Block;
+  uint16_t i, j, n, bLen;
+  uint16_t restLength = len;
+  uint16_t numBlocks = (len + 15) / 16;
+
+  // position in the fragments
+  uint8_t f = 0;
+  uint16_t o = 0;
+
+  for (i = 1; i <= numBlocks; i += n)
+  {
+    n = numBlocks - i + 1;
+    if (n > AES_PARALLEL_BLOCKS)
+      n = AES_PARALLEL_BLOCKS;
+
+    for (j = 0; j < n; j++)
+    {
+      Block = Block_A + (16 * j);
+      Block[0] = 0x01;
+      Block[1] = 0x00;
+      Block[2] = 0x00;
+      Block[3] = 0x00;
+      Block[4] = 0x00;
+      Block[5] = dir; // 0 is uplink
+      Block[6] = dev[3];
+      Block[7] = dev[2];
+      Block[8] = dev[1];
+      Block[9] = dev[0];
+      Block[10] = ( count ) & 0xFF; // 4 byte FCNT
+      Block[11] = ( count >> 8 ) & 0xFF;
+      Block[12] = ( count >> 16 ) & 0xFF;
+      Block[13] = ( count >> 24 ) & 0xFF;
+      Block[14] = 0x00;
+      Block[15] = i + j;
+    }
+
+    AES_Encrypt_Blocks(Block_A, n, aes);
+
+    bLen = 16 * n;
+    if (bLen > restLength)
+      bLen = restLength;
+    restLength -= bLen;
+
+    // the keystream of the pass may span several fragments
+    uint8_t *pass = out;
+    for (j = 0; j < bLen; )
+    {
+      while (o == fragments[f].Length)
+      {
+        f++;
+        o = 0;
+      }
+      uint16_t m = fragments[f].Length - o;
+      if (m > bLen - j)
+        m = bLen - j;
+      const uint8_t *data = fragments[f].Data + o;
+      for (uint16_t k = 0; k < m; k++)
+        *out++ = data[k] ^ Block_A[j + k];
+      j += m;
+      o += m;
+    }
+
+    if (ctx)
+      CMAC_Update(ctx, pass, bLen);
+  }
+}
+
+// ----------------------------------------------------------------------------
+// Parameters:
+//  - out: Encrypted payload, the sum of the fragment lengths
+//  - fragments: num pieces of the payload, in order
+//
+// Returns the length of the payload.
+// ----------------------------------------------------------------------------
+uint16_t PayloadEncode(uint8_t *out, const Payload_Fragment *fragments, uint8_t num, AES_Context *aes, uint8_t *dev, uint32_t count, uint8_t dir)
+{
+  uint16_t len = 0;
+  for (uint8_t f = 0; f < num; f++)
+    len += fragments[f].Length;
+
+  CRYPTO_TIME_START(t);
+  CRYPTO_COUNT(BytesEncrypted, len);
+  PayloadCtr(out, fragments, len, aes, dev, count, dir, NULL);
+  CRYPTO_TIME_STOP(CryptoStats.Ctr, t);
+  return len;
+}
+
+// ----------------------------------------------------------------------------
+// PayloadEncodeMic()
+// Encrypts the payload and computes the MIC of the frame in a single pass,
+// the same as PayloadEncode() followed by PayloadComputeMic(). The AES of
+// the keystream and of the CMAC use different keys, they run one after the
+// other in the same loop. Timed as Ctr, the MIC included.
+// Parameters:
+//  - frame: MHDR | FHDR | FPort, hlen bytes; the encrypted payload and the
+//           MIC are written after them
+//  - fragments: num pieces of the payload, in order, may be frame + hlen
+//  - aes: AppSKey, or NwkSKey for port 0
+//  - cmac: NwkSKey
+//
+// Returns the length of the frame with the MIC, or 0 when it is over 255.
+// ----------------------------------------------------------------------------
+uint16_t PayloadEncodeMic(uint8_t *frame, uint8_t hlen, const Payload_Fragment *fragments, uint8_t num, AES_Context *aes, CMAC_Key *cmac, uint8_t *dev, uint32_t count, uint8_t dir)
+{
+  uint16_t len = 0;
+  for (uint8_t f = 0; f < num; f++)
+    len += fragments[f].Length;
+  if (hlen + len > 255)
+    return 0;
+
+  CRYPTO_TIME_START(t);
+  CRYPTO_COUNT(BytesEncrypted, len);
+
+  uint8_t Block_B[16];
+  CMAC_Context ctx;
+
+  Block_B[0] = 0x49;
+  Block_B[1] = 0x00;
+  Block_B[2] = 0x00;
+  Block_B[3] = 0x00;
+  Block_B[4] = 0x00;
+  Block_B[5] = dir;
+  Block_B[6] = frame[1]; // 4 byte DevAddr
+  Block_B[7] = frame[2];
+  Block_B[8] = frame[3];
+  Block_B[9] = frame[4];
+  Block_B[10] = (count & 0xFF);
+  Block_B[11] = ((count >> 8) & 0xFF);
+  Block_B[12] = ((count >> 16) & 0xFF);
+  Block_B[13] = ((count >> 24) & 0xFF);
+  Block_B[14] = 0x00;
+  Block_B[15] = hlen + len;
+
+  CMAC_Init(&ctx, cmac);
+  CMAC_Update(&ctx, Block_B, 16);
+  CMAC_Update(&ctx, frame, hlen);
+  PayloadCtr(frame + hlen, fragments, len, aes, dev, count, dir, &ctx);
+  CMAC_Final(&ctx, Block_B);
+
+  memcpy(frame + hlen + len, Block_B, 4);
+  CRYPTO_TIME_STOP(CryptoStats.Ctr, t);
+  return hlen + len + 4;
+}
+
 // ----------------------------------------------------------------------------
 // PayloadComputeMic()
 // Provide a valid MIC 4-byte code (par 2.4 of spec, RFC4493)
@@ -629,16 +746,17 @@ uint8_t PayloadEncode(uint8_t *buf, uint8_t len, uint8_t *key, uint8_t *dev, uin
 //  - len:      8=bit length of data, normally less than 64 bytes
 //  - count: 16-bit framecounter
 //  - dir:      0=up, 1=down
+//  - mic:      4 bytes for the MIC, appended to data when not given
 //
 // B0 = ( 0x49 | 4 x 0x00 | Dir | 4 x DevAddr | 4 x FCnt |  0x00 | len )
 // MIC is cmac [0:3] of ( aes128_cmac(NwkSKey, B0 | Data )
 //
 // ----------------------------------------------------------------------------
-uint8_t PayloadComputeMic(uint8_t *data, uint8_t len, uint8_t *key, uint32_t count, uint8_t dir)
+uint8_t PayloadComputeMic(uint8_t *data, uint16_t len, CMAC_Key *cmac, uint32_t count, uint8_t dir, uint8_t *mic)
 {
   uint8_t Block_B[16];
-  uint8_t X[16];
   uint8_t Y[16];
+  CMAC_Context ctx;
 
   // ------------------------------------
   // build the B block used by the MIC process
@@ -681,93 +799,177 @@ uint8_t PayloadComputeMic(uint8_t *data, uint8_t len, uint8_t *key, uint32_t cou
   Block_B[15] = len; // 1 byte len
 
   // ------------------------------------
-  // Step 1: Generate the subkeys
+  // CMAC of B0 | data, the data is not copied
   //
-  uint8_t k1[16];
-  uint8_t k2[16];
-  generate_subkey(key, k1, k2);
+  CRYPTO_TIME_START(t);
+  CMAC_Init(&ctx, cmac);
+  CMAC_Update(&ctx, Block_B, 16);
+  CMAC_Update(&ctx, data, len);
+  CMAC_Final(&ctx, Y);
+  CRYPTO_TIME_STOP(CryptoStats.Mic, t);
 
   // ------------------------------------
-  // Copy the data to a new buffer which is prepended with Block B0
+  // Only 4 bytes are returned (32 bits), which is less than the RFC recommends.
   //
-  uint8_t micBuf[len + 16]; // B0 | data
-  for (uint8_t i = 0; i < 16; i++)
-    micBuf[i] = Block_B[i];
-  for (uint8_t i = 0; i < len; i++)
-    micBuf[i + 16] = data[i];
+  mic[0] = Y[0];
+  mic[1] = Y[1];
+  mic[2] = Y[2];
+  mic[3] = Y[3];
+  return 4;
+}
 
-  // ------------------------------------
-  // Step 2: Calculate the number of blocks for CMAC
-  //
-  uint8_t numBlocks = len / 16 + 1; // Compensate for B0 block
-  if ((len % 16) != 0)
-    numBlocks++; // If we have only a part block, take it all
+uint8_t PayloadComputeMic(uint8_t *data, uint16_t len, CMAC_Key *cmac, uint32_t count, uint8_t dir)
+{
+  // We return by appending 4 bytes to data, so there must be space in data array.
+  return PayloadComputeMic(data, len, cmac, count, dir, data + len);
+}
 
-  // ------------------------------------
-  // Step 3: Calculate padding is necessary
-  //
-  uint8_t restBits = len % 16; // if numBlocks is not a multiple of 16 bytes
+uint8_t PayloadComputeMic(uint8_t *data, uint16_t len, AES_Context *aes, uint32_t count, uint8_t dir)
+{
+  CMAC_Key cmac;
+  generate_cmac_key(&cmac, aes);
+  return PayloadComputeMic(data, len, &cmac, count, dir);
+}
 
-  // ------------------------------------
-  // Step 5: Make a buffer of zeros
-  //
-  memset(X, 0, 16);
+uint8_t PayloadComputeMic(uint8_t *data, uint16_t len, uint8_t *key, uint32_t count, uint8_t dir)
+{
+  CMAC_Key cmac;
+  generate_cmac_key(&cmac, key);
+  return PayloadComputeMic(data, len, &cmac, count, dir);
+}
+
+
+
+// ----------------------------------------------------------------------------
+// One step of num CMAC chains. A step holds at most MIC_MAX_CANDIDATES
+// blocks, one pass of the multi-block backends, and most frames have a
+// single candidate, which goes straight to AES_Encrypt().
+// ----------------------------------------------------------------------------
+static inline void MicEncrypt(uint8_t *X, uint8_t num, AES_Context *aes)
+{
+  if (num == 1)
+    AES_Encrypt(X, aes);
+  else
+    AES_Encrypt_Blocks(X, num, aes);
+}
+
+// ----------------------------------------------------------------------------
+// PayloadMatchMic()
+// Find which of several 32-bit frame counters gives the MIC of a frame.
+// Only B0 depends on the counter, so every candidate runs its own CMAC chain
+// over the same data blocks, read once, and the AES of all the chains in one
+// step are done together by MicEncrypt().
+// Parameters:
+//  - data:     uint8_t array of bytes = ( MHDR | FHDR | FPort | FRMPayload )
+//  - len:      8=bit length of data, without the MIC
+//  - count:    candidates for the 32-bit framecounter
+//  - num:      number of candidates, up to MIC_MAX_CANDIDATES
+//  - dir:      0=up, 1=down
+//  - mic:      4 bytes of the received MIC
+//
+// Returns the index of the matching candidate, or num when there is none.
+// ----------------------------------------------------------------------------
+uint8_t PayloadMatchMic(const uint8_t *data, uint16_t len, CMAC_Key *cmac, const uint32_t *count, uint8_t num, uint8_t dir, const uint8_t *mic)
+{
+  uint8_t X[16 * MIC_MAX_CANDIDATES];
+  uint8_t M[16];
+  uint8_t *B;
+  uint8_t i, c;
+
+  if (num > MIC_MAX_CANDIDATES)
+    num = MIC_MAX_CANDIDATES;
+
+  CRYPTO_TIME_START(t);
+  CRYPTO_COUNT(CmacCalls, num);
 
   // ------------------------------------
-  // Step 6: Do the actual encoding according to RFC
+  // First block of every chain is its own B0
   //
-  for (uint8_t i = 0x0; i < (numBlocks - 1); i++)
+  for (c = 0; c < num; c++)
   {
-    for (uint8_t j = 0; j < 16; j++)
-      Y[j] = micBuf[(i * 16) + j];
-    mXor(Y, X);
-    AES_Encrypt(Y, key);
-    for (uint8_t j = 0; j < 16; j++)
-      X[j] = Y[j];
+    B = X + (16 * c);
+    B[0] = 0x49;
+    B[1] = 0x00;
+    B[2] = 0x00;
+    B[3] = 0x00;
+    B[4] = 0x00;
+    B[5] = dir;
+    B[6] = data[1];
+    B[7] = data[2];
+    B[8] = data[3];
+    B[9] = data[4];
+    B[10] = (count[c] & 0xFF);
+    B[11] = ((count[c] >> 8) & 0xFF);
+    B[12] = ((count[c] >> 16) & 0xFF);
+    B[13] = ((count[c] >> 24) & 0xFF);
+    B[14] = 0x00;
+    B[15] = len;
   }
 
-  // ------------------------------------
-  // Step 4: If there is a rest Block, padd it
-  // Last block. We move step4 to the end as we need Y
-  // to compute the last block
-  //
-  if (restBits)
+  if (len == 0)
   {
-    for (uint8_t i = 0; i < 16; i++)
-    {
-      if (i < restBits)
-        Y[i] = micBuf[((numBlocks - 1) * 16) + i];
-      if (i == restBits)
-        Y[i] = 0x80;
-      if (i > restBits)
-        Y[i] = 0x00;
-    }
-    mXor(Y, k2);
+    // B0 alone is a whole last block
+    memcpy(M, cmac->K1, 16);
   }
   else
   {
-    for (uint8_t i = 0; i < 16; i++)
+    MicEncrypt(X, num, &cmac->Context);
+
+    // ------------------------------------
+    // Shared data blocks, the last one stays for the padding
+    //
+    while (len > 16)
     {
-      Y[i] = micBuf[((numBlocks - 1) * 16) + i];
+      for (c = 0; c < num; c++)
+        mXor(X + (16 * c), data);
+      MicEncrypt(X, num, &cmac->Context);
+      data += 16;
+      len -= 16;
     }
-    mXor(Y, k1);
+
+    for (i = 0; i < 16; i++)
+      M[i] = (i < len) ? data[i] : ((i == len) ? 0x80 : 0x00);
+    mXor(M, (len == 16) ? cmac->K1 : cmac->K2);
   }
-  mXor(Y, X);
-  AES_Encrypt(Y, key);
 
-  // ------------------------------------
-  // Step 7: done, return the MIC size.
-  // Only 4 bytes are returned (32 bits), which is less than the RFC recommends.
-  // We return by appending 4 bytes to data, so there must be space in data array.
-  //
-  data[len + 0] = Y[0];
-  data[len + 1] = Y[1];
-  data[len + 2] = Y[2];
-  data[len + 3] = Y[3];
-  return 4;
+  for (c = 0; c < num; c++)
+    mXor(X + (16 * c), M);
+  MicEncrypt(X, num, &cmac->Context);
+
+  // every candidate is compared, the first that matches is returned
+  i = num;
+  for (c = num; c-- > 0; )
+  {
+    if (MicEqual(X + (16 * c), mic))
+      i = c;
+  }
+  CRYPTO_TIME_STOP(CryptoStats.Mic, t);
+  return i;
 }
 
+// ----------------------------------------------------------------------------
+// PayloadCheckMic()
+// Checks the MIC at data + len for the 32-bit frame counter count, the CMAC
+// is computed over data where it is and nothing is written.
+// ----------------------------------------------------------------------------
+bool PayloadCheckMic(const uint8_t *data, uint16_t len, CMAC_Key *cmac, uint32_t count, uint8_t dir)
+{
+  return PayloadMatchMic(data, len, cmac, &count, 1, dir, data + len) == 0;
+}
 
+// ----------------------------------------------------------------------------
+// MicEqual()
+// Compares two 4-byte MICs in constant time, every byte is read whatever the
+// first difference, so the time does not tell how much of a forged MIC was
+// right.
+// ----------------------------------------------------------------------------
+bool MicEqual(const uint8_t *a, const uint8_t *b)
+{
+  uint8_t diff = 0;
+  for (uint8_t i = 0; i < 4; i++)
+    diff |= a[i] ^ b[i];
+  return diff == 0;
+}
 
 // ----------------------------------------------------------------------------
 // XOR()
@@ -775,7 +977,7 @@ uint8_t PayloadComputeMic(uint8_t *data, uint8_t len, uint8_t *key, uint32_t cou
 // Since we do this ONLY for keys and X, Y we know that we need to XOR 16 bytes.
 //
 // ----------------------------------------------------------------------------
-void mXor(uint8_t *buf, uint8_t *key)
+void mXor(uint8_t *buf, const uint8_t *key)
 {
   for (uint8_t i = 0; i < 16; ++i)
     buf[i] ^= key[i];
@@ -805,13 +1007,14 @@ void shift_left(uint8_t *buf, uint8_t len)
 // generate_subkey
 // RFC 4493, para 2.3
 // ----------------------------------------------------------------------------
-void generate_subkey(uint8_t *key, uint8_t *k1, uint8_t *k2)
+void generate_subkey(AES_Context *aes, uint8_t *k1, uint8_t *k2)
 {
+  CRYPTO_COUNT(Subkeys, 1);
 
   memset(k1, 0, 16); // Fill subkey1 with 0x00
 
   // Step 1: Assume k1 is an all zero block
-  AES_Encrypt(k1, key);
+  AES_Encrypt(k1, aes);
 
   // Step 2: Analyse outcome of Encrypt operation (in k1), generate k1
   if (k1[0] & 0x80)
@@ -841,5 +1044,106 @@ void generate_subkey(uint8_t *key, uint8_t *k1, uint8_t *k2)
   return;
 }
 
+void generate_subkey(uint8_t *key, uint8_t *k1, uint8_t *k2)
+{
+  AES_Context aes;
+  AES_Expand_Key(&aes, key);
+  generate_subkey(&aes, k1, k2);
+}
+
+// ----------------------------------------------------------------------------
+// generate_cmac_key
+// Expand the key and derive the subkeys k1 and k2 once, so every MIC
+// computed with the same key skips the AES of the zero block.
+// Call it again when the key changes.
+// ----------------------------------------------------------------------------
+void generate_cmac_key(CMAC_Key *cmac, AES_Context *aes)
+{
+  cmac->Context = *aes;
+  generate_subkey(aes, cmac->K1, cmac->K2);
+}
+
+void generate_cmac_key(CMAC_Key *cmac, uint8_t *key)
+{
+  AES_Expand_Key(&cmac->Context, key);
+  generate_subkey(&cmac->Context, cmac->K1, cmac->K2);
+}
+
+// ----------------------------------------------------------------------------
+// CMAC_Init / CMAC_Update / CMAC_Final
+// Incremental aes128_cmac (RFC 4493) over one or more pieces of data, read
+// where they are, without a copy of the whole message.
+// The last block has to be padded and mixed with k1 or k2, so every update
+// keeps up to 16 bytes pending until more data shows it is not the last one.
+// ----------------------------------------------------------------------------
+void CMAC_Init(CMAC_Context *ctx, CMAC_Key *cmac)
+{
+  CRYPTO_COUNT(CmacCalls, 1);
+  ctx->Key = cmac;
+  ctx->Length = 0;
+  memset(ctx->X, 0, 16);
+}
+
+void CMAC_Update(CMAC_Context *ctx, const uint8_t *data, uint16_t len)
+{
+  uint8_t i, n;
+
+  if (len == 0)
+    return;
+
+  // fill the pending block
+  n = 16 - ctx->Length;
+  if (n > len)
+    n = len;
+  for (i = 0; i < n; i++)
+    ctx->M[ctx->Length + i] = data[i];
+  ctx->Length += n;
+  data += n;
+  len -= n;
+  if (len == 0)
+    return;
+
+  // more data follows, so the pending block is not the last one
+  mXor(ctx->X, ctx->M);
+  AES_Encrypt(ctx->X, &ctx->Key->Context);
+
+  // whole blocks straight from data, keep the last one pending
+  while (len > 16)
+  {
+    for (i = 0; i < 16; i++)
+      ctx->X[i] ^= data[i];
+    AES_Encrypt(ctx->X, &ctx->Key->Context);
+    data += 16;
+    len -= 16;
+  }
+
+  for (i = 0; i < len; i++)
+    ctx->M[i] = data[i];
+  ctx->Length = len;
+}
+
+void CMAC_Final(CMAC_Context *ctx, uint8_t *mac)
+{
+  uint8_t i;
+
+  // If there is a rest Block, padd it
+  if (ctx->Length < 16)
+  {
+    ctx->M[ctx->Length] = 0x80;
+    for (i = ctx->Length + 1; i < 16; i++)
+      ctx->M[i] = 0x00;
+    mXor(ctx->M, ctx->Key->K2);
+  }
+  else
+  {
+    mXor(ctx->M, ctx->Key->K1);
+  }
+  mXor(ctx->M, ctx->X);
+  AES_Encrypt(ctx->M, &ctx->Key->Context);
+
+  for (i = 0; i < 16; i++)
+    mac[i] = ctx->M[i];
+}
+
 
 
@@ -39,26 +39,114 @@
 #ifndef __LORAMAC_CRYPTO_H__
 #define __LORAMAC_CRYPTO_H__
 
-void LoRaMacJoinComputeMic( uint8_t *data, uint8_t len, uint8_t *key, uint32_t *mic );
-void LoRaMacJoinDecrypt( uint8_t *data, uint8_t len, uint8_t *key);
-void LoRaMacJoinDecrypt( const uint8_t *data, uint8_t len, const uint8_t *key, uint8_t *decBuffer );
+#include "AES-128_V10.h"
+
+// Most 32-bit frame counters PayloadMatchMic() checks in one pass, up to 8
+// keeps each step to one pass of the bitsliced AES
+#ifndef MIC_MAX_CANDIDATES
+#define MIC_MAX_CANDIDATES 4
+#endif
+
+/*!
+ * AES-128 key schedule together with its CMAC subkeys K1 and K2,
+ * filled by generate_cmac_key() whenever the key changes.
+ */
+typedef struct
+{
+  AES_Context Context;
+  uint8_t K1[16];
+  uint8_t K2[16];
+} CMAC_Key;
+
+/*!
+ * State of a CMAC computed piece by piece with CMAC_Init(),
+ * CMAC_Update() and CMAC_Final().
+ */
+typedef struct
+{
+  CMAC_Key *Key;
+  uint8_t X[16];  // chaining value
+  uint8_t M[16];  // pending block
+  uint8_t Length; // bytes in M
+} CMAC_Context;
+
+/*!
+ * Piece of a payload given to PayloadEncode() in place of a
+ * contiguous buffer, the pieces follow each other in the frame.
+ */
+typedef struct
+{
+  const uint8_t *Data;
+  uint16_t Length;
+} Payload_Fragment;
+
+void LoRaMacJoinComputeMic( uint8_t *data, uint16_t len, uint8_t *key, uint32_t *mic );
+void LoRaMacJoinDecrypt( uint8_t *data, uint16_t len, uint8_t *key);
+void LoRaMacJoinDecrypt( const uint8_t *data, uint16_t len, const uint8_t *key, uint8_t *decBuffer );
 void LoRaMacJoinComputeSKeys( uint8_t *key, uint8_t *appNonce, uint16_t devNonce, uint8_t *nwkSKey, uint8_t *appSKey);
 
-void LoRaMacComputeMic( uint8_t *data, uint8_t len, uint8_t *key, uint32_t address, uint8_t dir, uint32_t count, uint32_t *mic );
-void LoRaMacPayloadEncrypt( uint8_t *data, uint8_t len, uint8_t *key, uint32_t address, uint8_t dir, uint32_t count );
-void LoRaMacPayloadEncrypt( uint8_t *data, uint8_t len, uint8_t *key, uint32_t address, uint8_t dir, uint32_t count, uint8_t *decBuffer);
-void LoRaMacPayloadDecrypt( uint8_t *data, uint8_t len, uint8_t *key, uint32_t address, uint8_t dir, uint32_t count );
-void LoRaMacPayloadDecrypt( uint8_t *data, uint8_t len, uint8_t *key, uint32_t address, uint8_t dir, uint32_t count, uint8_t *decBuffer );
+void LoRaMacComputeMic( uint8_t *data, uint16_t len, uint8_t *key, uint32_t address, uint8_t dir, uint32_t count, uint32_t *mic );
+void LoRaMacPayloadEncrypt( uint8_t *data, uint16_t len, uint8_t *key, uint32_t address, uint8_t dir, uint32_t count );
+void LoRaMacPayloadEncrypt( uint8_t *data, uint16_t len, uint8_t *key, uint32_t address, uint8_t dir, uint32_t count, uint8_t *decBuffer);
+void LoRaMacPayloadDecrypt( uint8_t *data, uint16_t len, uint8_t *key, uint32_t address, uint8_t dir, uint32_t count );
+void LoRaMacPayloadDecrypt( uint8_t *data, uint16_t len, uint8_t *key, uint32_t address, uint8_t dir, uint32_t count, uint8_t *decBuffer );
 
-uint8_t JoinComputeMic(uint8_t *data, uint8_t len, uint8_t *key);
-void JoinDecrypt(uint8_t *data, uint8_t len, uint8_t *key);
+uint8_t JoinComputeMic(uint8_t *data, uint16_t len, uint8_t *key);
+void JoinDecrypt(uint8_t *data, uint16_t len, uint8_t *key);
 void JoinComputeSKeys(uint8_t *key, uint8_t *appNonce, uint16_t devNonce, uint8_t *nwkSKey, uint8_t *appSKey);
 
-uint8_t PayloadEncode(uint8_t *buf, uint8_t len, uint8_t *key, uint8_t *dev, uint32_t count, uint8_t dir);
-uint8_t PayloadComputeMic(uint8_t *data, uint8_t len, uint8_t *key, uint32_t count, uint8_t dir);
+uint16_t PayloadEncode(uint8_t *buf, uint16_t len, uint8_t *key, uint8_t *dev, uint32_t count, uint8_t dir);
+uint8_t PayloadComputeMic(uint8_t *data, uint16_t len, uint8_t *key, uint32_t count, uint8_t dir);
 
-void mXor(uint8_t *buf, uint8_t *key);
+void mXor(uint8_t *buf, const uint8_t *key);
 void shift_left(uint8_t *buf, uint8_t len);
 void generate_subkey(uint8_t *key, uint8_t *k1, uint8_t *k2);
 
+// ----------------------------------------------- //
+// Same functions using a expanded key schedule
+// ----------------------------------------------- //
+
+void LoRaMacJoinComputeMic( uint8_t *data, uint16_t len, AES_Context *aes, uint32_t *mic );
+void LoRaMacJoinDecrypt( uint8_t *data, uint16_t len, AES_Context *aes);
+void LoRaMacJoinDecrypt( const uint8_t *data, uint16_t len, AES_Context *aes, uint8_t *decBuffer );
+void LoRaMacJoinComputeSKeys( AES_Context *aes, uint8_t *appNonce, uint16_t devNonce, uint8_t *nwkSKey, uint8_t *appSKey);
+
+void LoRaMacComputeMic( uint8_t *data, uint16_t len, AES_Context *aes, uint32_t address, uint8_t dir, uint32_t count, uint32_t *mic );
+void LoRaMacPayloadEncrypt( uint8_t *data, uint16_t len, AES_Context *aes, uint32_t address, uint8_t dir, uint32_t count );
+void LoRaMacPayloadEncrypt( uint8_t *data, uint16_t len, AES_Context *aes, uint32_t address, uint8_t dir, uint32_t count, uint8_t *decBuffer);
+void LoRaMacPayloadDecrypt( uint8_t *data, uint16_t len, AES_Context *aes, uint32_t address, uint8_t dir, uint32_t count );
+void LoRaMacPayloadDecrypt( uint8_t *data, uint16_t len, AES_Context *aes, uint32_t address, uint8_t dir, uint32_t count, uint8_t *decBuffer );
+
+uint8_t JoinComputeMic(uint8_t *data, uint16_t len, AES_Context *aes);
+void JoinDecrypt(uint8_t *data, uint16_t len, AES_Context *aes);
+void JoinComputeSKeys(AES_Context *aes, uint8_t *appNonce, uint16_t devNonce, uint8_t *nwkSKey, uint8_t *appSKey);
+
+uint16_t PayloadEncode(uint8_t *buf, uint16_t len, AES_Context *aes, uint8_t *dev, uint32_t count, uint8_t dir);
+uint16_t PayloadEncode(uint8_t *out, const Payload_Fragment *fragments, uint8_t num, AES_Context *aes, uint8_t *dev, uint32_t count, uint8_t dir);
+uint8_t PayloadComputeMic(uint8_t *data, uint16_t len, AES_Context *aes, uint32_t count, uint8_t dir);
+
+void generate_subkey(AES_Context *aes, uint8_t *k1, uint8_t *k2);
+
+// ----------------------------------------------- //
+// MIC functions using cached CMAC subkeys
+// ----------------------------------------------- //
+
+void LoRaMacJoinComputeMic( uint8_t *data, uint16_t len, CMAC_Key *cmac, uint32_t *mic );
+void LoRaMacComputeMic( uint8_t *data, uint16_t len, CMAC_Key *cmac, uint32_t address, uint8_t dir, uint32_t count, uint32_t *mic );
+uint8_t JoinComputeMic(uint8_t *data, uint16_t len, CMAC_Key *cmac);
+uint8_t PayloadComputeMic(uint8_t *data, uint16_t len, CMAC_Key *cmac, uint32_t count, uint8_t dir);
+uint8_t PayloadComputeMic(uint8_t *data, uint16_t len, CMAC_Key *cmac, uint32_t count, uint8_t dir, uint8_t *mic);
+uint8_t PayloadMatchMic(const uint8_t *data, uint16_t len, CMAC_Key *cmac, const uint32_t *count, uint8_t num, uint8_t dir, const uint8_t *mic);
+bool PayloadCheckMic(const uint8_t *data, uint16_t len, CMAC_Key *cmac, uint32_t count, uint8_t dir);
+bool JoinCheckMic(const uint8_t *data, uint16_t len, CMAC_Key *cmac);
+bool MicEqual(const uint8_t *a, const uint8_t *b);
+uint16_t PayloadEncodeMic(uint8_t *frame, uint8_t hlen, const Payload_Fragment *fragments, uint8_t num, AES_Context *aes, CMAC_Key *cmac, uint8_t *dev, uint32_t count, uint8_t dir);
+
+void generate_cmac_key(CMAC_Key *cmac, uint8_t *key);
+void generate_cmac_key(CMAC_Key *cmac, AES_Context *aes);
+
+void CMAC_Init(CMAC_Context *ctx, CMAC_Key *cmac);
+void CMAC_Update(CMAC_Context *ctx, const uint8_t *data, uint16_t len);
+void CMAC_Final(CMAC_Context *ctx, uint8_t *mac);
+
 #endif // __LORAMAC_CRYPTO_H__